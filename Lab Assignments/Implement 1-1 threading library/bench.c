@@ -0,0 +1,521 @@
+#include "thread.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOIN_SAMPLES 1000
+#define CREATE_BATCH 16
+#define CREATE_ROUNDS 625
+#define STRESS_CHILDREN 2000
+#define STRESS_MAX_CREATORS 16
+#define LOCK_OPS 2000000
+#define LOCK_MAX_THREADS 64
+#define FIB_N 38
+#define FIB_CUTOFF 20
+#define SUM_LEN (32 * 1024 * 1024)
+#define SUM_GRAIN (64 * 1024)
+#define PINGPONG_ROUNDS 200000
+#define RSS_THREADS 1000
+#define TLS_OPS 50000000
+#define TLS_THREADS 4
+#define QUEUE_MSGS 4000000
+#define QUEUE_CAPACITY 1024
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_distribution(const char *name, long *samples, int n) {
+    qsort(samples, n, sizeof(long), cmp_long);
+    printf("%-12s min %8.1fus  p50 %8.1fus  p90 %8.1fus  p99 %8.1fus  max %8.1fus\n", name,
+           samples[0] / 1e3, samples[n / 2] / 1e3, samples[n * 9 / 10] / 1e3,
+           samples[n * 99 / 100] / 1e3, samples[n - 1] / 1e3);
+}
+
+static volatile long exit_stamp;
+
+void *stamp_thread(void *arg) {
+    // give the joiner time to block before we finish
+    usleep(200);
+    exit_stamp = now_ns();
+    return NULL;
+}
+
+void bench_join() {
+    long *lat = malloc(JOIN_SAMPLES * sizeof(long));
+
+    for (int i = 0; i < JOIN_SAMPLES; i++) {
+        thread_t t;
+        if (thread_create(&t, stamp_thread, NULL) != 0) {
+            printf("thread_create failed at sample %d\n", i);
+            exit(1);
+        }
+        thread_join(t, NULL);
+        lat[i] = now_ns() - exit_stamp;
+    }
+
+    print_distribution("join", lat, JOIN_SAMPLES);
+    free(lat);
+}
+
+void *empty_thread(void *arg) {
+    return arg;
+}
+
+void bench_create() {
+    thread_t t[CREATE_BATCH];
+    long start = now_ns();
+
+    for (int r = 0; r < CREATE_ROUNDS; r++) {
+        for (int i = 0; i < CREATE_BATCH; i++) {
+            if (thread_create(&t[i], empty_thread, NULL) != 0) {
+                printf("thread_create failed in round %d\n", r);
+                exit(1);
+            }
+        }
+        for (int i = 0; i < CREATE_BATCH; i++) {
+            thread_join(t[i], NULL);
+        }
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-12s %d threads in %.3fs  %.0f threads/s\n", "create", CREATE_ROUNDS * CREATE_BATCH,
+           secs, CREATE_ROUNDS * CREATE_BATCH / secs);
+}
+
+void *creator_thread(void *arg) {
+    for (int i = 0; i < STRESS_CHILDREN; i++) {
+        thread_t t;
+        if (thread_create(&t, empty_thread, NULL) != 0) {
+            printf("thread_create failed in creator\n");
+            exit(1);
+        }
+        thread_join(t, NULL);
+    }
+    return NULL;
+}
+
+void bench_stress() {
+    thread_t creators[STRESS_MAX_CREATORS];
+
+    for (int n = 1; n <= STRESS_MAX_CREATORS; n *= 2) {
+        long start = now_ns();
+        for (int i = 0; i < n; i++) {
+            thread_create(&creators[i], creator_thread, NULL);
+        }
+        for (int i = 0; i < n; i++) {
+            thread_join(creators[i], NULL);
+        }
+        double secs = (now_ns() - start) / 1e9;
+        printf("%-12s %2d creators x %d children  %.0f threads/s\n", "stress", n, STRESS_CHILDREN,
+               n * STRESS_CHILDREN / secs);
+    }
+}
+
+enum { LOCK_THREAD_MUTEX, LOCK_PTHREAD_MUTEX, LOCK_THREAD_RWLOCK, LOCK_PTHREAD_RWLOCK };
+
+static thread_mutex_t bench_mutex = THREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t bench_pmutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_rwlock_t bench_rwlock = THREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t bench_prwlock = PTHREAD_RWLOCK_INITIALIZER;
+static long shared_counter;
+static int lock_kind, lock_iters;
+
+void *lock_thread(void *arg) {
+    long local = 0;
+
+    for (int i = 0; i < lock_iters; i++) {
+        // rwlock runs are 9 reads : 1 write
+        int write = i % 10 == 0;
+        switch (lock_kind) {
+        case LOCK_THREAD_MUTEX:
+            thread_mutex_lock(&bench_mutex);
+            shared_counter++;
+            thread_mutex_unlock(&bench_mutex);
+            break;
+        case LOCK_PTHREAD_MUTEX:
+            pthread_mutex_lock(&bench_pmutex);
+            shared_counter++;
+            pthread_mutex_unlock(&bench_pmutex);
+            break;
+        case LOCK_THREAD_RWLOCK:
+            if (write) thread_rwlock_wrlock(&bench_rwlock); else thread_rwlock_rdlock(&bench_rwlock);
+            if (write) shared_counter++; else local += shared_counter;
+            thread_rwlock_unlock(&bench_rwlock);
+            break;
+        case LOCK_PTHREAD_RWLOCK:
+            if (write) pthread_rwlock_wrlock(&bench_prwlock); else pthread_rwlock_rdlock(&bench_prwlock);
+            if (write) shared_counter++; else local += shared_counter;
+            pthread_rwlock_unlock(&bench_prwlock);
+            break;
+        }
+    }
+    return (void *)local;
+}
+
+void bench_locks() {
+    static const char *names[] = {"thread_mutex", "pthread_mutex", "thread_rw", "pthread_rw"};
+    thread_t t[LOCK_MAX_THREADS];
+
+    for (int n = 1; n <= LOCK_MAX_THREADS; n *= 2) {
+        printf("%-12s %2d threads ", "locks", n);
+        for (int kind = 0; kind < 4; kind++) {
+            lock_kind = kind;
+            lock_iters = LOCK_OPS / n;
+            long start = now_ns();
+            for (int i = 0; i < n; i++) {
+                thread_create(&t[i], lock_thread, NULL);
+            }
+            for (int i = 0; i < n; i++) {
+                thread_join(t[i], NULL);
+            }
+            double secs = (now_ns() - start) / 1e9;
+            printf(" %s %6.1fM/s", names[kind], (double)lock_iters * n / secs / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+static thread_pool_t *bench_pool;
+static long pool_result;
+
+static long fib_seq(int n) {
+    return n < 2 ? n : fib_seq(n - 1) + fib_seq(n - 2);
+}
+
+// fib(n) is the sum of the leaves, so tasks only add into pool_result
+void fib_task(void *arg) {
+    int n = (int)(long)arg;
+    if (n < FIB_CUTOFF) {
+        __atomic_fetch_add(&pool_result, fib_seq(n), __ATOMIC_RELAXED);
+        return;
+    }
+    pool_submit(bench_pool, fib_task, (void *)(long)(n - 1));
+    pool_submit(bench_pool, fib_task, (void *)(long)(n - 2));
+}
+
+static int *sum_data;
+
+void sum_task(void *arg) {
+    long range = (long)arg;
+    long lo = range >> 32, hi = range & 0xffffffff;
+    if (hi - lo > SUM_GRAIN) {
+        long mid = (lo + hi) / 2;
+        pool_submit(bench_pool, sum_task, (void *)(lo << 32 | mid));
+        pool_submit(bench_pool, sum_task, (void *)(mid << 32 | hi));
+        return;
+    }
+    long sum = 0;
+    for (long i = lo; i < hi; i++) {
+        sum += sum_data[i];
+    }
+    __atomic_fetch_add(&pool_result, sum, __ATOMIC_RELAXED);
+}
+
+void bench_pool_run() {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    double fib_base = 0, sum_base = 0;
+
+    sum_data = malloc(SUM_LEN * sizeof(int));
+    for (long i = 0; i < SUM_LEN; i++) {
+        sum_data[i] = i & 0xff;
+    }
+
+    for (int n = 1; n <= 2 * ncpu || n <= 4; n *= 2) {
+        bench_pool = pool_create(n);
+
+        pool_result = 0;
+        long start = now_ns();
+        pool_submit(bench_pool, fib_task, (void *)(long)FIB_N);
+        pool_wait(bench_pool);
+        double fib_secs = (now_ns() - start) / 1e9;
+        long fib = pool_result;
+
+        pool_result = 0;
+        start = now_ns();
+        pool_submit(bench_pool, sum_task, (void *)(long)SUM_LEN);
+        pool_wait(bench_pool);
+        double sum_secs = (now_ns() - start) / 1e9;
+
+        if (n == 1) {
+            fib_base = fib_secs;
+            sum_base = sum_secs;
+        }
+        printf("%-12s %2d workers  fib(%d)=%ld %.3fs (x%.2f)  sum=%ld %.3fs (x%.2f)\n", "pool", n, FIB_N, fib,
+               fib_secs, fib_base / fib_secs, pool_result, sum_secs, sum_base / sum_secs);
+        pool_destroy(bench_pool);
+    }
+    free(sum_data);
+}
+
+// Two threads hand a token back and forth; each round is two switches.
+static int turn;
+static thread_mutex_t pp_mutex = THREAD_MUTEX_INITIALIZER;
+static thread_cond_t pp_cond = THREAD_COND_INITIALIZER;
+static uthread_mutex_t upp_mutex;
+static uthread_cond_t upp_cond;
+
+void *pingpong_1to1(void *arg) {
+    int me = (int)(long)arg;
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        thread_mutex_lock(&pp_mutex);
+        while (turn != me) {
+            thread_cond_wait(&pp_cond, &pp_mutex);
+        }
+        turn = !me;
+        thread_cond_signal(&pp_cond);
+        thread_mutex_unlock(&pp_mutex);
+    }
+    return NULL;
+}
+
+void *pingpong_mn(void *arg) {
+    int me = (int)(long)arg;
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        uthread_mutex_lock(&upp_mutex);
+        while (turn != me) {
+            uthread_cond_wait(&upp_cond, &upp_mutex);
+        }
+        turn = !me;
+        uthread_cond_signal(&upp_cond);
+        uthread_mutex_unlock(&upp_mutex);
+    }
+    return NULL;
+}
+
+void *yield_loop(void *arg) {
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        thread_yield();
+    }
+    return arg;
+}
+
+void bench_pingpong() {
+    thread_t t[2];
+    uthread_t *u[2];
+
+    turn = 0;
+    long start = now_ns();
+    for (int i = 0; i < 2; i++) {
+        thread_create(&t[i], pingpong_1to1, (void *)(long)i);
+    }
+    for (int i = 0; i < 2; i++) {
+        thread_join(t[i], NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-12s 1:1 futex   %.2fM switches/s\n", "pingpong", 2.0 * PINGPONG_ROUNDS / secs / 1e6);
+
+    start = now_ns();
+    for (int i = 0; i < 2; i++) {
+        thread_create(&t[i], yield_loop, NULL);
+    }
+    for (int i = 0; i < 2; i++) {
+        thread_join(t[i], NULL);
+    }
+    secs = (now_ns() - start) / 1e9;
+    printf("%-12s 1:1 yield   %.2fM switches/s\n", "pingpong", 2.0 * PINGPONG_ROUNDS / secs / 1e6);
+
+    uthread_init(1);
+    uthread_mutex_init(&upp_mutex);
+    uthread_cond_init(&upp_cond);
+
+    turn = 0;
+    start = now_ns();
+    for (int i = 0; i < 2; i++) {
+        uthread_create(&u[i], pingpong_mn, (void *)(long)i);
+    }
+    for (int i = 0; i < 2; i++) {
+        uthread_join(u[i], NULL);
+    }
+    secs = (now_ns() - start) / 1e9;
+    printf("%-12s M:N cond    %.2fM switches/s\n", "pingpong", 2.0 * PINGPONG_ROUNDS / secs / 1e6);
+
+    start = now_ns();
+    for (int i = 0; i < 2; i++) {
+        uthread_create(&u[i], yield_loop, NULL);
+    }
+    for (int i = 0; i < 2; i++) {
+        uthread_join(u[i], NULL);
+    }
+    secs = (now_ns() - start) / 1e9;
+    printf("%-12s M:N yield   %.2fM switches/s\n", "pingpong", 2.0 * PINGPONG_ROUNDS / secs / 1e6);
+
+    uthread_shutdown();
+}
+
+static thread_mutex_t idle_lock = THREAD_MUTEX_INITIALIZER;
+
+void *idle_thread(void *arg) {
+    thread_mutex_lock(&idle_lock);
+    thread_mutex_unlock(&idle_lock);
+    return arg;
+}
+
+static long rss_kib() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void bench_rss() {
+    static thread_t t[RSS_THREADS];
+    size_t sizes[] = {THREAD_STACK_SIZE, 64 * 1024};
+
+    thread_cache_set_max(0);
+    for (int k = 0; k < 2; k++) {
+        thread_attr_t attr;
+        thread_attr_init(&attr);
+        thread_attr_setstacksize(&attr, sizes[k]);
+
+        long before = rss_kib();
+        thread_mutex_lock(&idle_lock);
+        for (int i = 0; i < RSS_THREADS; i++) {
+            thread_create_attr(&t[i], &attr, idle_thread, NULL);
+        }
+        // let every thread reach the lock
+        usleep(200000);
+        long after = rss_kib();
+        thread_mutex_unlock(&idle_lock);
+        for (int i = 0; i < RSS_THREADS; i++) {
+            thread_join(t[i], NULL);
+        }
+        printf("%-12s %4zu KiB stacks  %d idle threads  %.1f KiB RSS/thread  %zu MiB reserved\n", "rss",
+               sizes[k] / 1024, RSS_THREADS, (double)(after - before) / RSS_THREADS,
+               (sizes[k] + THREAD_GUARD_SIZE) * RSS_THREADS >> 20);
+    }
+    thread_cache_set_max(THREAD_CACHE_DEFAULT);
+}
+
+// per-thread counters three ways: adjacent slots of one shared array
+// (false sharing), __thread variables, and thread_getspecific lookups
+static long shared_counters[TLS_THREADS];
+static __thread long tls_counter;
+static thread_key_t counter_key;
+static int tls_kind;
+
+void *tls_worker(void *arg) {
+    long id = (long)arg;
+    long local = 0;
+
+    if (tls_kind == 2) {
+        thread_setspecific(counter_key, &local);
+    }
+    for (int i = 0; i < TLS_OPS / TLS_THREADS; i++) {
+        if (tls_kind == 0) {
+            (*(volatile long *)&shared_counters[id])++;
+        } else if (tls_kind == 1) {
+            (*(volatile long *)&tls_counter)++;
+        } else {
+            (*(volatile long *)thread_getspecific(counter_key))++;
+        }
+    }
+    return NULL;
+}
+
+void bench_tls() {
+    static const char *names[] = {"shared array", "__thread", "getspecific"};
+    thread_t t[TLS_THREADS];
+
+    thread_key_create(&counter_key, NULL);
+    for (int kind = 0; kind < 3; kind++) {
+        tls_kind = kind;
+        long start = now_ns();
+        for (long i = 0; i < TLS_THREADS; i++) {
+            thread_create(&t[i], tls_worker, (void *)i);
+        }
+        for (int i = 0; i < TLS_THREADS; i++) {
+            thread_join(t[i], NULL);
+        }
+        double secs = (now_ns() - start) / 1e9;
+        printf("%-12s %-13s %d threads  %.0fM incr/s\n", "tls", names[kind], TLS_THREADS, TLS_OPS / secs / 1e6);
+    }
+    thread_key_delete(counter_key);
+}
+
+// producers and consumers spin on the non-blocking queue, yielding the
+// CPU when it is full or empty
+static thread_queue_t bench_queue;
+static int queue_producers, queue_consumers;
+
+void *queue_producer(void *arg) {
+    long n = QUEUE_MSGS / queue_producers;
+    for (long i = 0; i < n; i++) {
+        while (thread_queue_push(&bench_queue, (void *)(i + 1)) != 0) {
+            sched_yield();
+        }
+    }
+    return arg;
+}
+
+void *queue_consumer(void *arg) {
+    long n = (long)arg;
+    void *item;
+    for (long i = 0; i < n; i++) {
+        while (thread_queue_pop(&bench_queue, &item) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void bench_queue_run() {
+    static const int ratios[][2] = {{1, 1}, {1, 4}, {4, 1}, {4, 4}, {8, 8}};
+    thread_t t[16];
+
+    thread_queue_init(&bench_queue, QUEUE_CAPACITY);
+    for (int r = 0; r < 5; r++) {
+        queue_producers = ratios[r][0];
+        queue_consumers = ratios[r][1];
+        long total = QUEUE_MSGS / queue_producers * queue_producers;
+
+        long start = now_ns();
+        for (int i = 0; i < queue_producers; i++) {
+            thread_create(&t[i], queue_producer, NULL);
+        }
+        for (int i = 0; i < queue_consumers; i++) {
+            // spread the total so the last consumer takes the remainder
+            long share = total / queue_consumers + (i == queue_consumers - 1 ? total % queue_consumers : 0);
+            thread_create(&t[queue_producers + i], queue_consumer, (void *)share);
+        }
+        for (int i = 0; i < queue_producers + queue_consumers; i++) {
+            thread_join(t[i], NULL);
+        }
+        double secs = (now_ns() - start) / 1e9;
+        printf("%-12s %d:%d producers:consumers  %.1fM msgs/s\n", "queue", queue_producers, queue_consumers,
+               total / secs / 1e6);
+    }
+    thread_queue_destroy(&bench_queue);
+}
+
+int main(int argc, char *argv[]) {
+    const char *which = argc > 1 ? argv[1] : "all";
+    int all = !strcmp(which, "all");
+
+    if (all || !strcmp(which, "join")) bench_join();
+    if (all || !strcmp(which, "create")) bench_create();
+    if (all || !strcmp(which, "stress")) bench_stress();
+    if (all || !strcmp(which, "locks")) bench_locks();
+    if (all || !strcmp(which, "pool")) bench_pool_run();
+    if (all || !strcmp(which, "pingpong")) bench_pingpong();
+    if (all || !strcmp(which, "rss")) bench_rss();
+    if (all || !strcmp(which, "tls")) bench_tls();
+    if (all || !strcmp(which, "queue")) bench_queue_run();
+    return 0;
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+# compare ./grep (new) against grep_ref on a set of queries
+B=${1:-./grep}; fail=0
+run(){ local mode="$1" pat="$2"; shift 2
+  if [ "$mode" = f ]; then a=$($B -f "$pat" "$@" | md5sum); b=$(./grep_ref -f "$pat" "$@" | md5sum)
+  elif [ "$mode" = E ]; then a=$(echo "$pat" | $B -E "$@" | md5sum); b=$(echo "$pat" | ./grep_ref -E "$@" | md5sum)
+  else a=$(echo "$pat" | $B "$@" | md5sum); b=$(echo "$pat" | ./grep_ref "$@" | md5sum); fi
+  [ "$a" = "$b" ] || { echo "MISMATCH $mode '$pat' $*"; fail=1; }; }
+for p in deadbeef "status=500 latency=39" "user=97 " "req=0" x; do run w "$p" log.txt; run w "$p" log.txt ids.txt; done
+for p in 'status=200 latency=29[0-9]ms$' '(GET|POST) /api/v2' 'user=(97|123|555) '; do run E "$p" log.txt; done
+run f ids.txt log.txt
+echo "check done fail=$fail"
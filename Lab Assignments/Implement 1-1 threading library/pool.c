@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include "thread.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define DEQUE_SIZE 4096
+#define INJECT_SIZE 4096
+#define IDLE_SPINS 64
+
+typedef struct {
+    void (*fn)(void *);
+    void *arg;
+} task_t;
+
+/*
+ * Chase-Lev work-stealing deque (the C11 formulation by Le et al.).
+ * The owning worker pushes and takes at bottom, thieves CAS top. Tasks
+ * are stored by value; a thief may read a slot the owner is rewriting,
+ * but then its CAS on top fails and the torn copy is discarded.
+ */
+typedef struct {
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    task_t buf[DEQUE_SIZE];
+} deque_t;
+
+typedef struct {
+    deque_t deque;
+    thread_pool_t *pool;
+    thread_t tid;
+    unsigned rng;
+} worker_t;
+
+struct thread_pool {
+    int nworkers;
+    worker_t *workers;
+
+    // submissions from threads outside the pool
+    thread_mutex_t inject_lock;
+    task_t inject[INJECT_SIZE];
+    int inject_head, inject_tail;
+
+    int pending __attribute__((aligned(64)));
+    int waiting;
+
+    // parking: idle_seq is the futex word. waking is claimed by the one
+    // submitter that issues a wake, so later submits skip the syscall
+    // until a parked worker has come out or gone back to sleep
+    int idle_seq __attribute__((aligned(64)));
+    int sleepers;
+    int waking;
+    int stop;
+};
+
+static void futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static int deque_push(deque_t *q, task_t t) {
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+    if (b - top >= DEQUE_SIZE) {
+        return -1;
+    }
+    task_t *slot = &q->buf[b & (DEQUE_SIZE - 1)];
+    __atomic_store_n(&slot->fn, t.fn, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, t.arg, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int deque_take(deque_t *q, task_t *t) {
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+    if (top > b) {
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    *t = q->buf[b & (DEQUE_SIZE - 1)];
+    if (top == b) {
+        // last element: race the thieves for it
+        int won = __atomic_compare_exchange_n(&q->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return won ? 0 : -1;
+    }
+    return 0;
+}
+
+static int deque_steal(deque_t *q, task_t *t) {
+    long top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= b) {
+        return -1;
+    }
+    task_t *slot = &q->buf[top & (DEQUE_SIZE - 1)];
+    t->fn = __atomic_load_n(&slot->fn, __ATOMIC_RELAXED);
+    t->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&q->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+static int inject_pop(thread_pool_t *pool, task_t *t) {
+    // unlocked peek so idle workers do not hammer the lock
+    if (__atomic_load_n(&pool->inject_head, __ATOMIC_RELAXED) == __atomic_load_n(&pool->inject_tail, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+
+    int ret = -1;
+    thread_mutex_lock(&pool->inject_lock);
+    if (pool->inject_head != pool->inject_tail) {
+        *t = pool->inject[pool->inject_head % INJECT_SIZE];
+        __atomic_store_n(&pool->inject_head, pool->inject_head + 1, __ATOMIC_RELAXED);
+        ret = 0;
+    }
+    thread_mutex_unlock(&pool->inject_lock);
+    return ret;
+}
+
+static void task_done(thread_pool_t *pool) {
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&pool->pending, INT_MAX);
+    }
+}
+
+static void run_task(thread_pool_t *pool, task_t t) {
+    t.fn(t.arg);
+    task_done(pool);
+}
+
+static void wake_worker(thread_pool_t *pool) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) == 0 ||
+        __atomic_exchange_n(&pool->waking, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_fetch_add(&pool->idle_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool->idle_seq, 1);
+}
+
+static int find_task(worker_t *w, task_t *t) {
+    thread_pool_t *pool = w->pool;
+
+    if (deque_take(&w->deque, t) == 0 || inject_pop(pool, t) == 0) {
+        return 0;
+    }
+
+    // start at a random victim so thieves spread out
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 17;
+    w->rng ^= w->rng << 5;
+    int start = w->rng % pool->nworkers;
+    for (int i = 0; i < pool->nworkers; i++) {
+        worker_t *victim = &pool->workers[(start + i) % pool->nworkers];
+        if (victim != w && deque_steal(&victim->deque, t) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    thread_pool_t *pool = w->pool;
+    task_t t;
+
+    thread_current()->pool_worker = w;
+
+    while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+        int found = -1;
+        for (int i = 0; i < IDLE_SPINS && found != 0; i++) {
+            found = find_task(w, &t);
+        }
+        if (found == 0) {
+            run_task(pool, t);
+            continue;
+        }
+
+        // park: register first, then look once more before sleeping
+        __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        int seq = __atomic_load_n(&pool->idle_seq, __ATOMIC_SEQ_CST);
+        found = find_task(w, &t);
+        if (found != 0 && !__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+            // any wake claimed before our seq sample has been delivered
+            __atomic_store_n(&pool->waking, 0, __ATOMIC_RELEASE);
+            futex_wait(&pool->idle_seq, seq);
+        }
+        __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->waking, 0, __ATOMIC_RELEASE);
+        if (found == 0) {
+            run_task(pool, t);
+        }
+    }
+    return NULL;
+}
+
+thread_pool_t *pool_create(int nworkers) {
+    if (nworkers <= 0) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    thread_pool_t *pool = aligned_alloc(64, sizeof(thread_pool_t));
+    worker_t *workers = aligned_alloc(64, sizeof(worker_t) * nworkers);
+    if (!pool || !workers) {
+        free(pool);
+        free(workers);
+        return NULL;
+    }
+    memset(pool, 0, sizeof(thread_pool_t));
+
+    pool->nworkers = nworkers;
+    pool->workers = workers;
+    thread_mutex_init(&pool->inject_lock);
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].deque.top = 0;
+        workers[i].deque.bottom = 0;
+        workers[i].pool = pool;
+        workers[i].rng = 2463534242u + i * 7919;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if (thread_create(&workers[i].tid, worker_main, &workers[i]) != 0) {
+            pool->nworkers = i;
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+int pool_submit(thread_pool_t *pool, void (*fn)(void *), void *arg) {
+    task_t t = {fn, arg};
+    tcb_t *self = thread_current();
+    worker_t *w = self ? self->pool_worker : NULL;
+
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_RELAXED);
+
+    if (w && w->pool == pool) {
+        if (deque_push(&w->deque, t) != 0) {
+            run_task(pool, t);
+            return 0;
+        }
+    } else {
+        thread_mutex_lock(&pool->inject_lock);
+        int full = pool->inject_tail - pool->inject_head >= INJECT_SIZE;
+        if (!full) {
+            pool->inject[pool->inject_tail % INJECT_SIZE] = t;
+            __atomic_store_n(&pool->inject_tail, pool->inject_tail + 1, __ATOMIC_RELAXED);
+        }
+        thread_mutex_unlock(&pool->inject_lock);
+        if (full) {
+            run_task(pool, t);
+            return 0;
+        }
+    }
+
+    wake_worker(pool);
+    return 0;
+}
+
+void pool_wait(thread_pool_t *pool) {
+    int p;
+
+    __atomic_store_n(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+    while ((p = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST)) != 0) {
+        futex_wait(&pool->pending, p);
+    }
+    __atomic_store_n(&pool->waiting, 0, __ATOMIC_RELAXED);
+}
+
+void pool_destroy(thread_pool_t *pool) {
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&pool->idle_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool->idle_seq, INT_MAX);
+
+    for (int i = 0; i < pool->nworkers; i++) {
+        thread_join(pool->workers[i].tid, NULL);
+    }
+    free(pool->workers);
+    free(pool);
+}
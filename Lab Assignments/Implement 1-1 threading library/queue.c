@@ -0,0 +1,85 @@
+#include "thread.h"
+#include <stdlib.h>
+
+/*
+ * Bounded MPMC queue after Vyukov. Every cell carries a sequence number
+ * that says whose turn it is: seq == pos means free for the producer that
+ * claims position pos, seq == pos + 1 means filled for the consumer of
+ * pos. Producers and consumers only contend on their own index (a CAS on
+ * tail or head) and then touch a cell nobody else owns, so there is no
+ * lock and no shared counter of items.
+ */
+struct queue_cell {
+    unsigned long seq;
+    void *item;
+};
+
+int thread_queue_init(thread_queue_t *q, unsigned long capacity) {
+    unsigned long size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    q->cells = aligned_alloc(64, ((size * sizeof(struct queue_cell)) + 63) & ~63UL);
+    if (!q->cells) {
+        return -1;
+    }
+    for (unsigned long i = 0; i < size; i++) {
+        q->cells[i].seq = i;
+    }
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+    return 0;
+}
+
+void thread_queue_destroy(thread_queue_t *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+int thread_queue_push(thread_queue_t *q, void *item) {
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct queue_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        long diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the consumer from one lap ago has not emptied it yet
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int thread_queue_pop(thread_queue_t *q, void **item) {
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct queue_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        long diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    *item = cell->item;
+    // hand the cell to the producer of the next lap
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "thread.h"
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SPIN_MAX 100
+
+static void futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void cpu_relax() {
+    __builtin_ia32_pause();
+}
+
+/*
+ * Mutex state: 0 unlocked, 1 locked, 2 locked with (possible) sleepers.
+ * Lock and unlock are a single CAS / fetch_sub when uncontended. Under
+ * contention we spin for an adaptive number of rounds (a running average
+ * of what it took to get the lock before, as glibc's adaptive mutex does)
+ * and only then mark the lock contended and sleep in the kernel.
+ */
+void thread_mutex_init(thread_mutex_t *m) {
+    m->state = 0;
+    m->spins = 0;
+}
+
+int thread_mutex_trylock(thread_mutex_t *m) {
+    int unlocked = 0;
+    return __atomic_compare_exchange_n(&m->state, &unlocked, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+int thread_mutex_lock(thread_mutex_t *m) {
+    int c = 0;
+    if (__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    int spins = __atomic_load_n(&m->spins, __ATOMIC_RELAXED);
+    int limit = spins * 2 + 10 < SPIN_MAX ? spins * 2 + 10 : SPIN_MAX;
+    int n;
+    for (n = 0; n < limit; n++) {
+        c = 0;
+        if (__atomic_load_n(&m->state, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&m->spins, spins + (n - spins) / 8, __ATOMIC_RELAXED);
+            return 0;
+        }
+        cpu_relax();
+    }
+    __atomic_store_n(&m->spins, spins + (n - spins) / 8, __ATOMIC_RELAXED);
+
+    while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(&m->state, 2);
+    }
+    return 0;
+}
+
+int thread_mutex_unlock(thread_mutex_t *m) {
+    if (__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+        futex_wake(&m->state, 1);
+    }
+    return 0;
+}
+
+/*
+ * The condition variable is a sequence number: a waiter samples it before
+ * dropping the mutex and sleeps only if nobody has signalled since. Woken
+ * waiters relock with the mutex marked contended so the next unlock wakes
+ * the one after them.
+ */
+void thread_cond_init(thread_cond_t *c) {
+    c->seq = 0;
+}
+
+int thread_cond_wait(thread_cond_t *c, thread_mutex_t *m) {
+    int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+
+    thread_mutex_unlock(m);
+    futex_wait(&c->seq, seq);
+
+    while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(&m->state, 2);
+    }
+    return 0;
+}
+
+int thread_cond_signal(thread_cond_t *c) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&c->seq, 1);
+    return 0;
+}
+
+int thread_cond_broadcast(thread_cond_t *c) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&c->seq, INT_MAX);
+    return 0;
+}
+
+/*
+ * Reader/writer lock: state > 0 counts readers, -1 means write-locked.
+ * Readers hold off while a writer is queued so writers are not starved.
+ * Readers and writers sleep on separate sequence words so a release hands
+ * the lock to one writer, or to all readers once no writer is asleep,
+ * instead of waking everyone to re-check. A sleeper announces itself before
+ * re-checking state and unlock publishes state before looking, so one of
+ * them always sees the other. writers_sleeping counts writers inside
+ * rwlock_sleep, so unlock only picks the writer path while one can really
+ * take the wake; otherwise it falls through to the readers.
+ * readers_sleeping is a flag the unlock claims, since all readers are woken
+ * at once and each re-sets it if it has to sleep again.
+ */
+void thread_rwlock_init(thread_rwlock_t *rw) {
+    rw->state = 0;
+    rw->writers_waiting = 0;
+    rw->readers_sleeping = 0;
+    rw->writers_sleeping = 0;
+    rw->reader_seq = 0;
+    rw->writer_seq = 0;
+}
+
+static int rwlock_blocked(thread_rwlock_t *rw, int writer) {
+    int s = __atomic_load_n(&rw->state, __ATOMIC_SEQ_CST);
+    if (writer) {
+        return s != 0;
+    }
+    return s < 0 || __atomic_load_n(&rw->writers_waiting, __ATOMIC_SEQ_CST) != 0;
+}
+
+static void rwlock_sleep(thread_rwlock_t *rw, int writer) {
+    int *sleeping = writer ? &rw->writers_sleeping : &rw->readers_sleeping;
+    int *seq = writer ? &rw->writer_seq : &rw->reader_seq;
+
+    if (writer) {
+        __atomic_fetch_add(sleeping, 1, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+    }
+    int val = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+    if (rwlock_blocked(rw, writer)) {
+        futex_wait(seq, val);
+    }
+    if (writer) {
+        __atomic_fetch_sub(sleeping, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+int thread_rwlock_rdlock(thread_rwlock_t *rw) {
+    for (int n = 0;; n++) {
+        int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+        if (s >= 0 && __atomic_load_n(&rw->writers_waiting, __ATOMIC_RELAXED) == 0) {
+            if (__atomic_compare_exchange_n(&rw->state, &s, s + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return 0;
+            }
+            continue;
+        }
+        if (n < SPIN_MAX) {
+            cpu_relax();
+            continue;
+        }
+
+        rwlock_sleep(rw, 0);
+    }
+}
+
+int thread_rwlock_wrlock(thread_rwlock_t *rw) {
+    int s = 0;
+    if (__atomic_compare_exchange_n(&rw->state, &s, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    __atomic_fetch_add(&rw->writers_waiting, 1, __ATOMIC_RELAXED);
+    for (int n = 0;; n++) {
+        s = 0;
+        if (__atomic_compare_exchange_n(&rw->state, &s, -1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (n < SPIN_MAX) {
+            cpu_relax();
+            continue;
+        }
+
+        rwlock_sleep(rw, 1);
+    }
+    __atomic_fetch_sub(&rw->writers_waiting, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int thread_rwlock_unlock(thread_rwlock_t *rw) {
+    int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+    if (s == -1) {
+        __atomic_store_n(&rw->state, 0, __ATOMIC_RELEASE);
+    } else if (__atomic_sub_fetch(&rw->state, 1, __ATOMIC_RELEASE) != 0) {
+        return 0;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rw->writers_sleeping, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_fetch_add(&rw->writer_seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&rw->writer_seq, 1);
+    } else if (__atomic_load_n(&rw->readers_sleeping, __ATOMIC_SEQ_CST) != 0 &&
+               __atomic_exchange_n(&rw->readers_sleeping, 0, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_fetch_add(&rw->reader_seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&rw->reader_seq, INT_MAX);
+    }
+    return 0;
+}
+
+/*
+ * Sense-reversing barrier: each phase flips sense, and waiters sleep on it
+ * until it differs from the value they arrived with. The last arrival
+ * resets remaining before flipping, so threads racing into the next phase
+ * always count against a full barrier.
+ */
+int thread_barrier_init(thread_barrier_t *b, int count) {
+    if (count <= 0) {
+        return -1;
+    }
+    b->count = count;
+    b->remaining = count;
+    b->sense = 0;
+    return 0;
+}
+
+int thread_barrier_wait(thread_barrier_t *b) {
+    int sense = __atomic_load_n(&b->sense, __ATOMIC_ACQUIRE);
+
+    if (__atomic_sub_fetch(&b->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n(&b->remaining, b->count, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->sense, !sense, __ATOMIC_RELEASE);
+        futex_wake(&b->sense, INT_MAX);
+        return 1;
+    }
+
+    for (int n = 0; n < SPIN_MAX; n++) {
+        if (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) != sense) {
+            return 0;
+        }
+        cpu_relax();
+    }
+    while (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) == sense) {
+        futex_wait(&b->sense, sense);
+    }
+    return 0;
+}
+
+/*
+ * Counting semaphore: value is the futex word and never goes negative.
+ * Posts only enter the kernel when someone has registered as a waiter.
+ */
+int thread_sem_init(thread_sem_t *s, int value) {
+    if (value < 0) {
+        return -1;
+    }
+    s->value = value;
+    s->waiters = 0;
+    return 0;
+}
+
+int thread_sem_trywait(thread_sem_t *s) {
+    int v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+    while (v > 0) {
+        if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int thread_sem_wait(thread_sem_t *s) {
+    for (int n = 0; n < SPIN_MAX; n++) {
+        if (thread_sem_trywait(s) == 0) {
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    while (thread_sem_trywait(s) != 0) {
+        futex_wait(&s->value, 0);
+    }
+    __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int thread_sem_post(thread_sem_t *s) {
+    __atomic_fetch_add(&s->value, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake(&s->value, 1);
+    }
+    return 0;
+}
@@ -2,10 +2,17 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define NUM_THREADS 5
 
 int global_counter = 0;
+thread_mutex_t counter_lock = THREAD_MUTEX_INITIALIZER;
+thread_cond_t counter_cond = THREAD_COND_INITIALIZER;
+thread_rwlock_t table_lock = THREAD_RWLOCK_INITIALIZER;
+int table[16];
 
 void *counter_thread(void *arg) {
     int id = *(int *)arg;
@@ -44,6 +51,103 @@ void *sync_thread(void *arg) {
     return (void *)(long)id;
 }
 
+void *self_thread(void *arg) {
+    return (void *)(long)thread_self();
+}
+
+void *locked_increment_thread(void *arg) {
+    for (int i = 0; i < 100000; i++) {
+        thread_mutex_lock(&counter_lock);
+        global_counter++;
+        thread_mutex_unlock(&counter_lock);
+    }
+    return NULL;
+}
+
+void *waiter_thread(void *arg) {
+    int target = *(int *)arg;
+    thread_mutex_lock(&counter_lock);
+    while (global_counter < target) {
+        thread_cond_wait(&counter_cond, &counter_lock);
+    }
+    thread_mutex_unlock(&counter_lock);
+    return NULL;
+}
+
+void *table_thread(void *arg) {
+    long bad = 0;
+    int writer = *(int *)arg;
+    
+    for (int i = 0; i < 20000; i++) {
+        if (writer) {
+            thread_rwlock_wrlock(&table_lock);
+            for (int j = 0; j < 16; j++) table[j]++;
+        } else {
+            thread_rwlock_rdlock(&table_lock);
+            for (int j = 1; j < 16; j++) if (table[j] != table[0]) bad++;
+        }
+        thread_rwlock_unlock(&table_lock);
+    }
+    return (void *)bad;
+}
+
+thread_rwlock_t handoff_lock = THREAD_RWLOCK_INITIALIZER;
+
+void *handoff_thread(void *arg) {
+    if (arg) {
+        thread_rwlock_wrlock(&handoff_lock);
+    } else {
+        thread_rwlock_rdlock(&handoff_lock);
+    }
+    thread_rwlock_unlock(&handoff_lock);
+    return arg;
+}
+
+thread_pool_t *count_pool;
+long pool_total = 0;
+
+void count_task(void *arg) {
+    long n = (long)arg;
+    if (n > 1) {
+        pool_submit(count_pool, count_task, (void *)(n / 2));
+        pool_submit(count_pool, count_task, (void *)(n - n / 2));
+        return;
+    }
+    __atomic_fetch_add(&pool_total, 1, __ATOMIC_RELAXED);
+}
+
+uthread_mutex_t ucounter_lock;
+int ucounter = 0;
+
+void *uthread_counter(void *arg) {
+    for (int i = 0; i < 100; i++) {
+        uthread_mutex_lock(&ucounter_lock);
+        int v = ucounter;
+        thread_yield();
+        ucounter = v + 1;
+        uthread_mutex_unlock(&ucounter_lock);
+    }
+    return arg;
+}
+
+void *uthread_parent(void *arg) {
+    uthread_t *child;
+    void *retval;
+    uthread_create(&child, uthread_counter, (void *)7L);
+    uthread_join(child, &retval);
+    return (void *)((long)retval * 2);
+}
+
+int recurse(int depth) {
+    volatile char pad[512];
+    pad[0] = depth;
+    return depth == 0 ? pad[0] : recurse(depth - 1) + pad[0];
+}
+
+void *deep_thread(void *arg) {
+    return (void *)(long)recurse((int)(long)arg);
+}
+
 void test_basic() {
     printf("\nBasic Creation\n");
     thread_t threads[3];
@@ -100,6 +204,12 @@ void test_multiple() {
     }
 }
 
+thread_t join_target;
+
+void *joiner_thread(void *arg) {
+    return thread_join(join_target, NULL) == 0 ? arg : NULL;
+}
+
 void test_errors() {
     printf("\nError Cases\n");
     
@@ -115,6 +225,350 @@ void test_errors() {
     if (thread_join(thread, NULL) == -1) {
         printf("Correctly failed to join already joined thread\n");
     }
+    
+    if (thread_getspecific(-1) == NULL && thread_getspecific(THREAD_KEYS_MAX) == NULL) {
+        printf("Correctly returned NULL for out-of-range keys\n");
+    }
+    
+    // two joiners race for each thread; with the cache off the loser would
+    // read an unmapped TCB if it got past the claim
+    thread_cache_set_max(0);
+    int wins = 0;
+    for (int i = 0; i < 200; i++) {
+        thread_t a, b;
+        void *ra, *rb;
+        thread_create(&join_target, self_thread, NULL);
+        thread_create(&a, joiner_thread, (void *)1L);
+        thread_create(&b, joiner_thread, (void *)1L);
+        thread_join(a, &ra);
+        thread_join(b, &rb);
+        wins += (ra != NULL) + (rb != NULL);
+    }
+    thread_cache_set_max(THREAD_CACHE_DEFAULT);
+    printf("200 racing joins: %d won (expected 200)\n", wins);
+}
+
+void test_tid_reuse() {
+    printf("\nTid Reuse\n");
+    int mismatches = 0;
+    
+    for (int i = 0; i < 5000; i++) {
+        thread_t thread;
+        if (thread_create(&thread, self_thread, NULL) != 0) {
+            printf("thread_create failed after %d threads\n", i);
+            return;
+        }
+        void *retval;
+        thread_join(thread, &retval);
+        if ((thread_t)(long)retval != thread) {
+            mismatches++;
+        }
+    }
+    printf("Created and joined 5000 threads, %d thread_self mismatches\n", mismatches);
+    printf("thread_self in main returned %d\n", thread_self());
+}
+
+void *spawner_thread(void *arg) {
+    long joined = 0;
+    
+    for (int i = 0; i < 200; i++) {
+        thread_t child;
+        if (thread_create(&child, self_thread, NULL) != 0) {
+            continue;
+        }
+        void *retval;
+        if (thread_join(child, &retval) == 0 && (thread_t)(long)retval == child) {
+            joined++;
+        }
+    }
+    return (void *)joined;
+}
+
+void test_concurrent_create() {
+    printf("\nConcurrent Creators\n");
+    thread_t threads[8];
+    long total = 0;
+    
+    for (int i = 0; i < 8; i++) {
+        thread_create(&threads[i], spawner_thread, NULL);
+    }
+    for (int i = 0; i < 8; i++) {
+        void *retval;
+        thread_join(threads[i], &retval);
+        total += (long)retval;
+    }
+    printf("8 creators joined %ld of 1600 children\n", total);
+}
+
+void test_sync() {
+    printf("\nMutex, Condition Variable and RW Lock\n");
+    thread_t threads[4];
+    
+    global_counter = 0;
+    for (int i = 0; i < 4; i++) {
+        thread_create(&threads[i], locked_increment_thread, NULL);
+    }
+    for (int i = 0; i < 4; i++) {
+        thread_join(threads[i], NULL);
+    }
+    printf("Counter is %d (expected 400000)\n", global_counter);
+    
+    int target = 400010;
+    for (int i = 0; i < 2; i++) {
+        thread_create(&threads[i], waiter_thread, &target);
+    }
+    for (int i = 0; i < 10; i++) {
+        thread_mutex_lock(&counter_lock);
+        global_counter++;
+        thread_cond_broadcast(&counter_cond);
+        thread_mutex_unlock(&counter_lock);
+    }
+    for (int i = 0; i < 2; i++) {
+        thread_join(threads[i], NULL);
+    }
+    printf("Waiters woke at counter %d\n", global_counter);
+    
+    int roles[4] = {1, 0, 0, 1};
+    long bad = 0;
+    for (int i = 0; i < 4; i++) {
+        thread_create(&threads[i], table_thread, &roles[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        void *retval;
+        thread_join(threads[i], &retval);
+        bad += (long)retval;
+    }
+    printf("Readers saw %ld torn tables, writes %d (expected 40000)\n", bad, table[0]);
+    
+    // a writer and a reader both asleep behind a writer: the lock must go
+    // to the writer, then on to the reader once the second writer is done
+    thread_rwlock_wrlock(&handoff_lock);
+    thread_create(&threads[0], handoff_thread, (void *)1L);
+    thread_create(&threads[1], handoff_thread, NULL);
+    while (__atomic_load_n(&handoff_lock.writers_sleeping, __ATOMIC_SEQ_CST) == 0 ||
+           __atomic_load_n(&handoff_lock.readers_sleeping, __ATOMIC_SEQ_CST) == 0) {
+        usleep(1000);
+    }
+    alarm(10);   // a lost wake-up hangs the joins below
+    thread_rwlock_unlock(&handoff_lock);
+    thread_join(threads[0], NULL);
+    thread_join(threads[1], NULL);
+    alarm(0);
+    printf("Writer then reader took the lock after a writer handoff\n");
+}
+
+void test_pool() {
+    printf("\nThread Pool\n");
+    count_pool = pool_create(4);
+    
+    for (int i = 0; i < 10; i++) {
+        pool_submit(count_pool, count_task, (void *)1000L);
+    }
+    pool_wait(count_pool);
+    printf("Pool counted %ld leaves (expected 10000)\n", pool_total);
+    pool_destroy(count_pool);
+}
+
+void test_uthreads() {
+    printf("\nM:N User Threads\n");
+    uthread_t *threads[50];
+    void *retval;
+    
+    uthread_init(2);
+    uthread_mutex_init(&ucounter_lock);
+    for (int i = 0; i < 50; i++) {
+        uthread_create(&threads[i], uthread_counter, NULL);
+    }
+    for (int i = 0; i < 50; i++) {
+        uthread_join(threads[i], NULL);
+    }
+    printf("Counter is %d (expected 5000)\n", ucounter);
+    
+    uthread_create(&threads[0], uthread_parent, NULL);
+    uthread_join(threads[0], &retval);
+    printf("Nested join returned %ld\n", (long)retval);
+    uthread_shutdown();
+}
+
+void test_attr() {
+    printf("\nThread Attributes\n");
+    thread_attr_t attr;
+    thread_t thread;
+    
+    thread_attr_init(&attr);
+    thread_attr_setstacksize(&attr, 64 * 1024);
+    thread_attr_setaffinity(&attr, 1UL);
+    if (thread_create_attr(&thread, &attr, deep_thread, (void *)50L) == 0 &&
+        thread_join(thread, NULL) == 0) {
+        printf("64 KiB stack pinned to CPU 0 ran 50 frames\n");
+    }
+    
+    // CPU 63 is offline on anything with fewer CPUs, so pinning there must fail
+    thread_attr_setaffinity(&attr, 1UL << 63);
+    if (thread_create_attr(&thread, &attr, deep_thread, (void *)50L) == -1) {
+        printf("Correctly failed to pin a thread to an offline CPU\n");
+    }
+    thread_attr_setaffinity(&attr, 1UL);
+    
+    // overflowing a small stack must hit the guard page, so do it in a child
+    pid_t pid = fork();
+    if (pid == 0) {
+        thread_create_attr(&thread, &attr, deep_thread, (void *)100000L);
+        thread_join(thread, NULL);
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV) {
+        printf("Stack overflow hit the guard page\n");
+    }
+}
+
+static __thread int tls_value = 7;
+static thread_key_t dtor_key;
+static int dtors_run;
+
+void count_dtor(void *value) {
+    __atomic_fetch_add(&dtors_run, (int)(long)value, __ATOMIC_RELAXED);
+}
+
+void *tls_thread(void *arg) {
+    // every thread starts from the initial image, not the creator's copy
+    int fresh = tls_value == 7;
+    tls_value = (int)(long)arg;
+    thread_setspecific(dtor_key, (void *)1L);
+    
+    for (int i = 0; i < 1000; i++) {
+        tls_value++;
+    }
+    return (void *)(long)(fresh && tls_value == (int)(long)arg + 1000 && errno == 0);
+}
+
+void *malloc_thread(void *arg) {
+    free(malloc(100));
+    return (void *)(long)(tls_value == 7);
+}
+
+long resident_kib() {
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void test_tls() {
+    printf("\nThread-Local Storage\n");
+    thread_t threads[8];
+    void *retval;
+    int ok = 0;
+    
+    thread_key_create(&dtor_key, count_dtor);
+    tls_value = -1;
+    for (int i = 0; i < 8; i++) {
+        thread_create(&threads[i], tls_thread, (void *)(long)(i * 10000));
+    }
+    for (int i = 0; i < 8; i++) {
+        thread_join(threads[i], &retval);
+        ok += (long)retval;
+    }
+    printf("%d of 8 threads had private __thread copies, main still sees %d\n", ok, tls_value);
+    printf("Key destructors ran %d times (expected 8)\n", dtors_run);
+    thread_key_delete(dtor_key);
+    
+    // a slot's TLS block goes to the next thread in it, so glibc's
+    // per-thread malloc state is reused rather than leaked each time
+    long before = resident_kib();
+    ok = 0;
+    for (int i = 0; i < 5000; i++) {
+        thread_create(&threads[0], malloc_thread, NULL);
+        thread_join(threads[0], &retval);
+        ok += (long)retval;
+    }
+    printf("5000 malloc/free threads: %d saw fresh TLS, RSS grew by %ld KiB\n", ok, resident_kib() - before);
+}
+
+static thread_barrier_t phase_barrier;
+static int phase_count[100];
+static int phase_errors, serial_threads;
+
+void *phase_thread(void *arg) {
+    for (int p = 0; p < 100; p++) {
+        __atomic_fetch_add(&phase_count[p], 1, __ATOMIC_RELAXED);
+        if (thread_barrier_wait(&phase_barrier)) {
+            __atomic_fetch_add(&serial_threads, 1, __ATOMIC_RELAXED);
+        }
+        // everyone must have arrived before anyone leaves
+        if (__atomic_load_n(&phase_count[p], __ATOMIC_RELAXED) != 8) {
+            __atomic_fetch_add(&phase_errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return arg;
+}
+
+// the queue never blocks, so the semaphores count free and filled slots;
+// a permit can still arrive before the cell it maps to is handed over by a
+// slower thread, so both sides retry until the queue agrees
+static thread_queue_t msg_queue;
+static thread_sem_t msg_slots, msg_items;
+static long msg_sum;
+
+void *producer_thread(void *arg) {
+    for (long i = 1; i <= 10000; i++) {
+        thread_sem_wait(&msg_slots);
+        while (thread_queue_push(&msg_queue, (void *)i) != 0) {
+            thread_yield();
+        }
+        thread_sem_post(&msg_items);
+    }
+    return arg;
+}
+
+void *consumer_thread(void *arg) {
+    void *item;
+    long sum = 0;
+    
+    for (int i = 0; i < 10000; i++) {
+        thread_sem_wait(&msg_items);
+        while (thread_queue_pop(&msg_queue, &item) != 0) {
+            thread_yield();
+        }
+        thread_sem_post(&msg_slots);
+        sum += (long)item;
+    }
+    __atomic_fetch_add(&msg_sum, sum, __ATOMIC_RELAXED);
+    return arg;
+}
+
+void test_handoff() {
+    printf("\nBarrier, Semaphore and Queue\n");
+    thread_t threads[8];
+    
+    thread_barrier_init(&phase_barrier, 8);
+    for (int i = 0; i < 8; i++) {
+        thread_create(&threads[i], phase_thread, NULL);
+    }
+    for (int i = 0; i < 8; i++) {
+        thread_join(threads[i], NULL);
+    }
+    printf("100 barrier phases: %d early leavers, %d serial threads (expected 100)\n", phase_errors, serial_threads);
+    
+    thread_queue_init(&msg_queue, 64);
+    thread_sem_init(&msg_slots, 64);
+    thread_sem_init(&msg_items, 0);
+    for (int i = 0; i < 4; i++) {
+        thread_create(&threads[i], producer_thread, NULL);
+        thread_create(&threads[i + 4], consumer_thread, NULL);
+    }
+    for (int i = 0; i < 8; i++) {
+        thread_join(threads[i], NULL);
+    }
+    printf("Consumers received sum %ld (expected %ld)\n", msg_sum, 4 * 10000L * 10001 / 2);
+    thread_queue_destroy(&msg_queue);
 }
 
 int main() {
@@ -125,6 +579,14 @@ int main() {
     test_exit();
     test_multiple();
     test_errors();
+    test_tid_reuse();
+    test_concurrent_create();
+    test_sync();
+    test_pool();
+    test_uthreads();
+    test_attr();
+    test_tls();
+    test_handoff();
     
     printf("\nAll tests completed\n");
 }
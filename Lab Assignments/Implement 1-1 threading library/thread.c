@@ -1,3 +1,21 @@
+/*
+ * One-to-one threads on raw clone(), x86-64 only. glibc never learns about
+ * these threads, which leaves some limits (details at tls_new below):
+ *
+ * - Static TLS comes from glibc's private _dl_allocate_tls only on the
+ *   glibc releases whose tcbhead_t layout is known. Elsewhere the library
+ *   builds the block itself and shares the creator's dtv, so __thread
+ *   variables reached through __tls_get_addr (-fPIC code, dlopen()ed
+ *   libraries) are not per-thread there.
+ * - glibc's struct pthread behind the thread pointer stays zeroed apart
+ *   from the rseq area, so pthread_self(), cancellation, robust mutexes
+ *   and other pthread calls must not be used from these threads.
+ * - A slot's TLS block is reused by the next thread in the slot. Our and
+ *   the program's __thread variables start from their initial values and
+ *   errno from 0, but libc's own per-thread state (malloc tcache and
+ *   arena, uselocale(), resolver state) carries over, and TLS of libraries
+ *   dlopen()ed after startup is not reset.
+ */
 #define _GNU_SOURCE
 #include "thread.h"
 #include <stdlib.h>
@@ -7,105 +25,619 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <sched.h>
+#include <linux/futex.h>
+#include <asm/prctl.h>
+#include <pthread.h>
+#include <string.h>
+#include <link.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
 
-#define MAX_THREADS 1024
+#define TID_SLOT_BITS 10
+#define MAX_THREADS (1 << TID_SLOT_BITS)
+#define TID_SLOT(tid) ((tid) & (MAX_THREADS - 1))
+#define TID_GEN_MASK (0x7fffffff >> TID_SLOT_BITS)
 
 static tcb_t *thread_table[MAX_THREADS];
-static int next_tid = 0;
+
+// Free slots of thread_table form a Treiber stack threaded through
+// slot_next[]. The head packs an ABA tag in the upper 32 bits and
+// slot index + 1 in the lower 32 (0 = empty). Slots never handed out
+// yet are taken from slot_hwm instead, so no init pass is needed.
+static unsigned long slot_head = 0;
+static int slot_next[MAX_THREADS];
+static int slot_hwm = 0;
+
+// Bumped on every reuse so a stale thread_t cannot join a recycled slot.
+// Generations run from 1, so no thread_t is 0.
+static int slot_gen[MAX_THREADS];
+
+// The thread_t still waiting to be joined in each slot, 0 once a joiner has
+// claimed it. Joiners claim it before they look at the TCB.
+static int slot_tid[MAX_THREADS];
+
+// gs:0 holds the running thread's tcb_t.self. The main thread gets a
+// dummy TCB whose self is NULL.
+static tcb_t main_tcb;
+
+static void set_self(tcb_t *tcb) {
+    syscall(SYS_arch_prctl, ARCH_SET_GS, tcb);
+}
+
+static tcb_t *current_tcb() {
+    tcb_t *self;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+/*
+ * Every thread gets its own copy of the static TLS block, with the thread
+ * pointer (fs base) just above it, so __thread variables (ours, the
+ * program's and glibc's, errno and malloc's tcache included) are private.
+ * There are two ways to get one:
+ *
+ * - From the dynamic linker through _dl_allocate_tls, the call
+ *   pthread_create makes. This also gives the block its own dtv. It is a
+ *   GLIBC_PRIVATE symbol and the tcbhead_t fields have to be filled in by
+ *   hand, so this path is only taken on the glibc releases whose layout is
+ *   known (THREAD_GLIBC_MIN..THREAD_GLIBC_MAX).
+ * - Otherwise the block is laid out from the PT_TLS segments that
+ *   dl_iterate_phdr reports, and the creator's tcbhead is copied in. The
+ *   dtv is then the creator's, so TLS reached through __tls_get_addr
+ *   (-fPIC code, dlopen()ed libraries) is shared with it.
+ *
+ * Blocks are never freed. Each thread_table slot keeps its block, and the
+ * next thread in the slot gets it back with every module's TLS reset to
+ * its initial image except libc's. glibc releases a thread's tcache and
+ * arena only on its own thread exit path, which these threads do not
+ * take; keeping libc's part hands that state to the next thread instead
+ * of leaking it, so memory is bounded by the slots ever in use at once.
+ */
+#ifndef THREAD_GLIBC_MIN
+#define THREAD_GLIBC_MIN 34
+#endif
+#ifndef THREAD_GLIBC_MAX
+#define THREAD_GLIBC_MAX 39
+#endif
+
+extern void *_dl_allocate_tls(void *mem) __attribute__((weak));
+
+#define TCBHEAD_TCB 0x00
+#define TCBHEAD_SELF 0x10
+#define TCBHEAD_MULTIPLE_THREADS 0x18
+#define TCBHEAD_STACK_GUARD 0x28
+#define TCBHEAD_POINTER_GUARD 0x30
+#define TCBHEAD_COPY 0x38
+
+// Room above the thread pointer for the tcbhead and glibc's struct pthread
+// behind it, which stays zeroed in fallback blocks
+#define TLS_TCB_RESERVE (16 * 1024)
 
 typedef struct {
-    void *(*start_routine)(void *);
-    void *arg;
-    thread_t tid;
-} thread_args_t;
+    unsigned long offset;  // the module's block starts at tp - offset
+    const void *image;
+    size_t filesz, memsz;
+    int libc;
+} tls_module_t;
 
-static int thread_start(void *arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    void *(*start_routine)(void *) = args->start_routine;
-    void *routine_arg = args->arg;
-    thread_t tid = args->tid;
+static tls_module_t *tls_modules;
+static int tls_nmodules;
+static size_t tls_static_size;  // bytes below the thread pointer
+static int tls_from_glibc;
+static void *slot_tls[MAX_THREADS];
+
+static char *thread_pointer() {
+    char *tp;
+    __asm__("mov %%fs:0, %0" : "=r"(tp));
+    return tp;
+}
+
+// Records where each module's static TLS sits relative to the thread
+// pointer; run from the constructor, before any dlopen() can add modules
+static int tls_add_module(struct dl_phdr_info *info, size_t size, void *tp) {
+    (void)size;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_TLS || !info->dlpi_tls_data || (char *)info->dlpi_tls_data >= (char *)tp) {
+            continue;
+        }
+        tls_module_t *m = realloc(tls_modules, (tls_nmodules + 1) * sizeof(tls_module_t));
+        if (!m) {
+            return 1;
+        }
+        tls_modules = m;
+        m += tls_nmodules++;
+        m->offset = (char *)tp - (char *)info->dlpi_tls_data;
+        m->image = (const char *)info->dlpi_addr + ph->p_vaddr;
+        m->filesz = ph->p_filesz;
+        m->memsz = ph->p_memsz;
+        m->libc = strstr(info->dlpi_name, "/libc.so") || !strncmp(info->dlpi_name, "libc.so", 7);
+        if (m->offset > tls_static_size) {
+            tls_static_size = m->offset;
+        }
+    }
+    return 0;
+}
+
+static void tls_init() {
+    dl_iterate_phdr(tls_add_module, thread_pointer());
+    tls_static_size = (tls_static_size + 4095) & ~4095UL;
     
-    tcb_t *tcb = thread_table[tid];
-    tcb->kernel_tid = syscall(SYS_gettid);
+#if defined(__GLIBC__) && !defined(THREAD_NO_GLIBC_TLS)
+    int major, minor;
+    if (_dl_allocate_tls && sscanf(gnu_get_libc_version(), "%d.%d", &major, &minor) == 2) {
+        tls_from_glibc = major == 2 && minor >= THREAD_GLIBC_MIN && minor <= THREAD_GLIBC_MAX;
+    }
+#endif
+}
+
+// Puts every module's TLS back to its initial image, libc's too unless
+// keep_libc is set
+static void tls_reset(char *tp, int keep_libc) {
+    for (int i = 0; i < tls_nmodules; i++) {
+        tls_module_t *m = &tls_modules[i];
+        if (keep_libc && m->libc) {
+            continue;
+        }
+        memcpy(tp - m->offset, m->image, m->filesz);
+        memset(tp - m->offset + m->filesz, 0, m->memsz - m->filesz);
+    }
+}
+
+static char *tls_block_new() {
+    char *base = mmap(NULL, tls_static_size + TLS_TCB_RESERVE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    tls_reset(base + tls_static_size, 0);
+    return base + tls_static_size;
+}
+
+// Returns the thread pointer for a new thread in slot, with the tcbhead
+// filled in like TLS_INIT_TP does and the stack/pointer guards copied from
+// the creating thread
+static void *tls_new(int slot) {
+    char *tp = slot_tls[slot];
     
-    free(args);
+    if (tp) {
+        tls_reset(tp, 1);
+    } else {
+        tp = tls_from_glibc ? _dl_allocate_tls(NULL) : tls_block_new();
+        if (!tp) {
+            return NULL;
+        }
+        slot_tls[slot] = tp;
+    }
     
-    void *retval = start_routine(routine_arg);
+    if (tls_from_glibc) {
+        unsigned long stack_guard, pointer_guard;
+        __asm__("mov %%fs:0x28, %0" : "=r"(stack_guard));
+        __asm__("mov %%fs:0x30, %0" : "=r"(pointer_guard));
+        *(int *)(tp + TCBHEAD_MULTIPLE_THREADS) = 1;
+        *(unsigned long *)(tp + TCBHEAD_STACK_GUARD) = stack_guard;
+        *(unsigned long *)(tp + TCBHEAD_POINTER_GUARD) = pointer_guard;
+    } else {
+        memcpy(tp, thread_pointer(), TCBHEAD_COPY);
+    }
+    *(void **)(tp + TCBHEAD_TCB) = tp;
+    *(void **)(tp + TCBHEAD_SELF) = tp;
+    return tp;
+}
+
+#ifdef RSEQ_SIG
+// glibc's sched_getcpu() reads the cpu_id of the rseq area in struct
+// pthread, which is zeroed here and would always say CPU 0. Register it
+// with the kernel as glibc does for its own threads, or mark it failed so
+// glibc falls back to getcpu().
+static void rseq_register(char *tp) {
+    if (__rseq_offset <= 0 || (!tls_from_glibc && __rseq_offset + sizeof(struct rseq) > TLS_TCB_RESERVE)) {
+        return;
+    }
+    struct rseq *rs = (struct rseq *)(tp + __rseq_offset);
+    rs->cpu_id = RSEQ_CPU_ID_REGISTRATION_FAILED;
+    if (__rseq_size) {
+        syscall(SYS_rseq, rs, sizeof(struct rseq), 0, RSEQ_SIG);
+    }
+}
+#else
+static void rseq_register(char *tp) {
+    (void)tp;
+}
+#endif
+
+static void *noop_thread(void *arg) {
+    return arg;
+}
+
+__attribute__((constructor)) static void thread_lib_init() {
+    main_tcb.self = NULL;
+    set_self(&main_tcb);
+    tls_init();
+    
+    // glibc only leaves its single-threaded fast paths (unlocked malloc,
+    // non-atomic lll_lock) once it has created a thread itself
+    pthread_t p;
+    if (pthread_create(&p, NULL, noop_thread, NULL) == 0) {
+        pthread_join(p, NULL);
+    }
+}
+
+/*
+ * thread_key_t values live in a __thread array, so lookups are one
+ * fs-relative load. Each key carries a sequence number bumped on create,
+ * so values stored under a deleted key are not seen by its next owner.
+ */
+typedef struct {
+    unsigned seq;
+    void *value;
+} specific_t;
+
+static __thread specific_t specific[THREAD_KEYS_MAX];
+static unsigned key_seq[THREAD_KEYS_MAX];  // odd = in use
+static void (*key_destructor[THREAD_KEYS_MAX])(void *);
+
+int thread_key_create(thread_key_t *key, void (*destructor)(void *)) {
+    for (int k = 0; k < THREAD_KEYS_MAX; k++) {
+        unsigned seq = __atomic_load_n(&key_seq[k], __ATOMIC_RELAXED);
+        if (!(seq & 1) && __atomic_compare_exchange_n(&key_seq[k], &seq, seq + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&key_destructor[k], destructor, __ATOMIC_RELEASE);
+            *key = k;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int thread_key_delete(thread_key_t key) {
+    if (key < 0 || key >= THREAD_KEYS_MAX || !(key_seq[key] & 1)) {
+        return -1;
+    }
+    __atomic_store_n(&key_destructor[key], NULL, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&key_seq[key], 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *thread_getspecific(thread_key_t key) {
+    if (key < 0 || key >= THREAD_KEYS_MAX) {
+        return NULL;
+    }
+    specific_t *sp = &specific[key];
+    return sp->seq == __atomic_load_n(&key_seq[key], __ATOMIC_RELAXED) ? sp->value : NULL;
+}
+
+int thread_setspecific(thread_key_t key, const void *value) {
+    if (key < 0 || key >= THREAD_KEYS_MAX) {
+        return -1;
+    }
+    specific[key].seq = __atomic_load_n(&key_seq[key], __ATOMIC_RELAXED);
+    specific[key].value = (void *)value;
+    return 0;
+}
+
+static void run_destructors() {
+    // destructors may set other keys again; give up after a few passes
+    for (int pass = 0; pass < 4; pass++) {
+        int ran = 0;
+        for (int k = 0; k < THREAD_KEYS_MAX; k++) {
+            void (*destructor)(void *) = __atomic_load_n(&key_destructor[k], __ATOMIC_ACQUIRE);
+            void *value = thread_getspecific(k);
+            if (destructor && value) {
+                specific[k].value = NULL;
+                destructor(value);
+                ran = 1;
+            }
+        }
+        if (!ran) {
+            break;
+        }
+    }
+}
+
+static int slot_alloc() {
+    unsigned long head = __atomic_load_n(&slot_head, __ATOMIC_ACQUIRE);
+    
+    while ((unsigned)head != 0) {
+        int slot = (unsigned)head - 1;
+        unsigned long next = ((head >> 32) + 1) << 32 | (unsigned)__atomic_load_n(&slot_next[slot], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&slot_head, &head, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return slot;
+        }
+    }
+    
+    int slot = __atomic_fetch_add(&slot_hwm, 1, __ATOMIC_RELAXED);
+    if (slot >= MAX_THREADS) {
+        __atomic_fetch_sub(&slot_hwm, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return slot;
+}
+
+static void slot_free(int slot) {
+    unsigned long head = __atomic_load_n(&slot_head, __ATOMIC_RELAXED);
+    unsigned long next;
+    
+    do {
+        __atomic_store_n(&slot_next[slot], (unsigned)head, __ATOMIC_RELAXED);
+        next = ((head >> 32) + 1) << 32 | (unsigned)(slot + 1);
+    } while (!__atomic_compare_exchange_n(&slot_head, &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// A joined TCB stays parked on its free slot together with its (already
+// faulted-in) stack, so whoever allocates the slot next reuses it. The slot
+// stack already gives the ownership/ABA guarantees a separate list would need.
+// At most cache_max TCBs are parked; lowering the mark takes effect as parked
+// TCBs get reused.
+static tcb_t *slot_cache[MAX_THREADS];
+static int cache_count = 0;
+static int cache_max = THREAD_CACHE_DEFAULT;
+
+// kernel_tid is cleared and woken by the kernel (CLONE_CHILD_CLEARTID) with a
+// shared futex wake, so the wait must not use FUTEX_PRIVATE_FLAG
+static int futex_wait(pid_t *addr, pid_t val) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static int futex_wake(int *addr) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// kernel zeroes kernel_tid once the thread is gone and off its stack
+static void wait_exited(tcb_t *tcb) {
+    pid_t ktid;
+    while ((ktid = __atomic_load_n(&tcb->kernel_tid, __ATOMIC_ACQUIRE)) != 0) {
+        futex_wait(&tcb->kernel_tid, ktid);
+    }
+}
+
+// The TCB lives at the top of its own stack mapping rather than in malloc'd
+// memory, so creating a thread costs no allocator round trip beyond TLS.
+// The lowest page of the mapping is a PROT_NONE guard so an overflow faults
+// instead of running into the neighbouring mapping. MAP_NORESERVE keeps the
+// untouched part of the stack out of commit accounting; pages are only
+// backed once the thread actually touches them.
+static tcb_t *tcb_new(size_t stack_size, int populate) {
+    size_t map_size = (stack_size + THREAD_GUARD_SIZE + 4095) & ~4095UL;
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE | (populate ? MAP_POPULATE : 0);
+    char *stack = mmap(NULL, map_size, PROT_READ | PROT_WRITE, mflags, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(stack, THREAD_GUARD_SIZE, PROT_NONE) != 0) {
+        munmap(stack, map_size);
+        return NULL;
+    }
+    
+    tcb_t *tcb = (tcb_t *)(((unsigned long)stack + map_size - sizeof(tcb_t)) & ~63UL);
+    tcb->stack = stack;
+    tcb->map_size = map_size;
+    return tcb;
+}
+
+static void tcb_free(tcb_t *tcb) {
+    munmap(tcb->stack, tcb->map_size);
+}
+
+static tcb_t *tcb_alloc(int slot, size_t stack_size) {
+    tcb_t *tcb = slot_cache[slot];
+    
+    if (tcb) {
+        slot_cache[slot] = NULL;
+        __atomic_fetch_sub(&cache_count, 1, __ATOMIC_RELAXED);
+        if (tcb->map_size == ((stack_size + THREAD_GUARD_SIZE + 4095) & ~4095UL)) {
+            return tcb;
+        }
+        tcb_free(tcb);
+    }
+    return tcb_new(stack_size, 0);
+}
+
+static void tcb_release(int slot, tcb_t *tcb) {
+    int max = __atomic_load_n(&cache_max, __ATOMIC_RELAXED);
+    
+    if (__atomic_fetch_add(&cache_count, 1, __ATOMIC_RELAXED) < max) {
+        slot_cache[slot] = tcb;
+        return;
+    }
+    __atomic_fetch_sub(&cache_count, 1, __ATOMIC_RELAXED);
+    tcb_free(tcb);
+}
+
+void thread_cache_set_max(int max) {
+    __atomic_store_n(&cache_max, max < 0 ? 0 : max, __ATOMIC_RELAXED);
+}
+
+int thread_cache_prefill(int count) {
+    int held[MAX_THREADS];
+    int nheld = 0, added = 0;
+    
+    // hold every slot we look at so the same slot is not popped twice
+    while (added < count && nheld < MAX_THREADS) {
+        int slot = slot_alloc();
+        if (slot < 0) {
+            break;
+        }
+        held[nheld++] = slot;
+        if (slot_cache[slot]) {
+            continue;
+        }
+        
+        tcb_t *tcb = tcb_new(THREAD_STACK_SIZE, 1);
+        if (!tcb) {
+            break;
+        }
+        tcb_release(slot, tcb);
+        if (!slot_cache[slot]) {
+            break;
+        }
+        added++;
+    }
+    
+    while (nheld > 0) {
+        slot_free(held[--nheld]);
+    }
+    return added;
+}
+
+static int thread_start(void *arg) {
+    tcb_t *tcb = (tcb_t *)arg;
+    
+    set_self(tcb);
+    rseq_register(tcb->tls);
+    errno = 0;
+    // a pinned thread waits until the creator has applied its mask
+    int gate;
+    while ((gate = __atomic_load_n(&tcb->start_gate, __ATOMIC_ACQUIRE)) == 0) {
+        futex_wait(&tcb->start_gate, 0);
+    }
+    if (gate < 0) {
+        syscall(SYS_exit, 0);
+    }
+    void *retval = tcb->start_routine(tcb->arg);
     thread_exit(retval);
     return 0;
 }
 
+void thread_attr_init(thread_attr_t *attr) {
+    attr->stack_size = THREAD_STACK_SIZE;
+    attr->cpu_mask = 0;
+}
+
+int thread_attr_setstacksize(thread_attr_t *attr, size_t stack_size) {
+    if (stack_size < THREAD_STACK_MIN) {
+        return -1;
+    }
+    attr->stack_size = stack_size;
+    return 0;
+}
+
+int thread_attr_setaffinity(thread_attr_t *attr, unsigned long cpu_mask) {
+    attr->cpu_mask = cpu_mask;
+    return 0;
+}
+
 int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg) {
-    if (next_tid >= MAX_THREADS) {
+    return thread_create_attr(thread, NULL, start_routine, arg);
+}
+
+int thread_create_attr(thread_t *thread, const thread_attr_t *attr, void *(*start_routine)(void *), void *arg) {
+    size_t stack_size = attr ? attr->stack_size : THREAD_STACK_SIZE;
+    
+    int slot = slot_alloc();
+    if (slot < 0) {
         return -1;
     }
     
-    tcb_t *tcb = malloc(sizeof(tcb_t));
-    void *stack = mmap(NULL, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0); 
-    void *stack_top = (char *)stack + THREAD_STACK_SIZE;
-    thread_args_t *args = malloc(sizeof(thread_args_t));
+    tcb_t *tcb = tcb_alloc(slot, stack_size);
+    if (!tcb) {
+        slot_free(slot);
+        return -1;
+    }
+    tcb->tls = tls_new(slot);
+    if (!tcb->tls) {
+        tcb_release(slot, tcb);
+        slot_free(slot);
+        return -1;
+    }
+    void *stack_top = (void *)((unsigned long)tcb & ~15UL);
     
-    tcb->tid = next_tid;
+    slot_gen[slot] = slot_gen[slot] % TID_GEN_MASK + 1;
+    tcb->self = tcb;
+    __atomic_store_n(&tcb->tid, slot_gen[slot] << TID_SLOT_BITS | slot, __ATOMIC_RELAXED);
     tcb->state = THREAD_RUNNING;
     tcb->retval = NULL;
     tcb->kernel_tid = 0;
-    tcb->stack = stack;
-    
-    args->start_routine = start_routine;
-    args->arg = arg;
-    args->tid = next_tid;
+    tcb->start_routine = start_routine;
+    tcb->arg = arg;
+    tcb->pool_worker = NULL;
+    tcb->uthread_worker = NULL;
+    tcb->cpu_mask = attr ? attr->cpu_mask : 0;
+    tcb->start_gate = tcb->cpu_mask ? 0 : 1;
     
-    thread_table[next_tid] = tcb;
+    __atomic_store_n(&thread_table[slot], tcb, __ATOMIC_RELEASE);
     
-    int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM;
+    int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM |
+                CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID | CLONE_SETTLS;
     
-    pid_t pid = clone(thread_start, stack_top, flags, args);
+    pid_t pid = clone(thread_start, stack_top, flags, tcb, &tcb->kernel_tid, tcb->tls, &tcb->kernel_tid);
     
     if (pid == -1) {
-        thread_table[next_tid] = NULL;
-        free(args);
-        munmap(stack, THREAD_STACK_SIZE);
-        free(tcb);
+        __atomic_store_n(&thread_table[slot], NULL, __ATOMIC_RELAXED);
+        tcb_release(slot, tcb);
+        slot_free(slot);
         return -1;
     }
     
-    *thread = next_tid;
-    next_tid++;
+    // The mask is applied here rather than by the thread itself so that a
+    // bad or offline mask fails thread_create_attr; the thread is held at
+    // its start gate meanwhile and leaves without running start_routine.
+    if (tcb->cpu_mask) {
+        int ok = syscall(SYS_sched_setaffinity, pid, sizeof(tcb->cpu_mask), &tcb->cpu_mask) == 0;
+        __atomic_store_n(&tcb->start_gate, ok ? 1 : -1, __ATOMIC_RELEASE);
+        futex_wake(&tcb->start_gate);
+        if (!ok) {
+            wait_exited(tcb);
+            __atomic_store_n(&thread_table[slot], NULL, __ATOMIC_RELAXED);
+            tcb_release(slot, tcb);
+            slot_free(slot);
+            return -1;
+        }
+    }
+    
+    *thread = tcb->tid;
+    __atomic_store_n(&slot_tid[slot], tcb->tid, __ATOMIC_RELEASE);
     
     return 0;
 }
 
 int thread_join(thread_t thread, void **retval) {
-    if (thread >= next_tid || thread < 0 || !thread_table[thread]) {
+    if (thread < 0) {
         return -1;
     }
     
-    tcb_t *tcb = thread_table[thread];
-    
-    while (tcb->state != THREAD_TERMINATED) {
-        usleep(1000);
+    // Only one joiner can claim a given thread_t, and the generation in it
+    // makes a stale one fail too. Losers leave here without reading the
+    // TCB, which the winner may unmap or hand to a new thread.
+    int slot = TID_SLOT(thread);
+    int expected = thread;
+    if (!__atomic_compare_exchange_n(&slot_tid[slot], &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return -1;
     }
     
+    tcb_t *tcb = __atomic_load_n(&thread_table[slot], __ATOMIC_ACQUIRE);
+    wait_exited(tcb);
+    __atomic_store_n(&thread_table[slot], NULL, __ATOMIC_RELAXED);
+    
     if (retval) {
         *retval = tcb->retval;
     }
     
-    munmap(tcb->stack, THREAD_STACK_SIZE);
-    free(tcb);
-    thread_table[thread] = NULL;
+    tcb_release(slot, tcb);
+    slot_free(slot);
     
     return 0;
 }
 
+tcb_t *thread_current() {
+    return current_tcb();
+}
+
+thread_t thread_self() {
+    tcb_t *tcb = current_tcb();
+    return tcb ? tcb->tid : -1;
+}
+
 void thread_exit(void *retval) {
-    pid_t current_tid = syscall(SYS_gettid);
+    tcb_t *tcb = current_tcb();
     
-    for (int i = 0; i < next_tid; i++) {
-        if (thread_table[i] && thread_table[i]->kernel_tid == current_tid) {
-            thread_table[i]->retval = retval;
-            thread_table[i]->state = THREAD_TERMINATED;
-            break;
-        }
+    if (tcb) {
+        run_destructors();
+        tcb->retval = retval;
+        __atomic_store_n(&tcb->state, THREAD_TERMINATED, __ATOMIC_RELEASE);
     }
     
     syscall(SYS_exit, 0);
@@ -4,25 +4,182 @@
 #include <sys/types.h>
 
 #define THREAD_STACK_SIZE (1024 * 1024)
+#define THREAD_STACK_MIN (16 * 1024)
+#define THREAD_GUARD_SIZE 4096
+#define THREAD_KEYS_MAX 64
+#define THREAD_CACHE_DEFAULT 16
+#define UTHREAD_STACK_SIZE (64 * 1024)
 
 typedef int thread_t;
+typedef int thread_key_t;
 
 typedef enum {
     THREAD_RUNNING = 0,
     THREAD_TERMINATED = 1
 } thread_state_t;
 
-typedef struct {
+typedef struct tcb {
+    struct tcb *self;  // must stay first, read through %gs:0
     thread_t tid;
     thread_state_t state;
     void *retval;
     pid_t kernel_tid;
     void *stack;
+    void *tls;  // thread pointer handed to CLONE_SETTLS
+    size_t map_size;
+    unsigned long cpu_mask;
+    int start_gate;  // 0 until the creator has pinned the thread, -1 if that failed
+    void *(*start_routine)(void *);
+    void *arg;
+    void *pool_worker;  // set while the thread serves a thread_pool_t
+    void *uthread_worker;  // set while the thread runs M:N uthreads
 } tcb_t;
 
+// stack_size excludes the guard page; cpu_mask pins the thread to the set
+// bits (CPU n = bit n), 0 leaves the affinity inherited
+typedef struct {
+    size_t stack_size;
+    unsigned long cpu_mask;
+} thread_attr_t;
+
+typedef struct {
+    int state;
+    int spins;
+} thread_mutex_t;
+
+typedef struct {
+    int seq;
+} thread_cond_t;
+
+typedef struct {
+    int state;
+    int writers_waiting;
+    int readers_sleeping;
+    int writers_sleeping;
+    int reader_seq;
+    int writer_seq;
+} thread_rwlock_t;
+
+typedef struct {
+    int count;
+    int remaining;
+    int sense;
+} thread_barrier_t;
+
+typedef struct {
+    int value;
+    int waiters;
+} thread_sem_t;
+
+// head and tail sit on their own cache lines so producers and consumers
+// do not invalidate each other's line on every operation
+typedef struct {
+    struct queue_cell *cells;
+    unsigned long mask;
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+} __attribute__((aligned(64))) thread_queue_t;
+
+typedef struct thread_pool thread_pool_t;
+typedef struct uthread uthread_t;
+
+typedef struct {
+    int lock;
+    int locked;
+    uthread_t *head, *tail;
+} uthread_mutex_t;
+
+typedef struct {
+    int lock;
+    uthread_t *head, *tail;
+} uthread_cond_t;
+
+#define THREAD_MUTEX_INITIALIZER {0, 0}
+#define THREAD_COND_INITIALIZER {0}
+#define THREAD_RWLOCK_INITIALIZER {0, 0, 0, 0, 0, 0}
+#define THREAD_BARRIER_INITIALIZER(n) {n, n, 0}
+#define THREAD_SEM_INITIALIZER(n) {n, 0}
+
 int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg);
+int thread_create_attr(thread_t *thread, const thread_attr_t *attr, void *(*start_routine)(void *), void *arg);
 int thread_join(thread_t thread, void **retval);
 void thread_exit(void *retval);
+thread_t thread_self(void);
+tcb_t *thread_current(void);
+
+void thread_attr_init(thread_attr_t *attr);
+int thread_attr_setstacksize(thread_attr_t *attr, size_t stack_size);
+int thread_attr_setaffinity(thread_attr_t *attr, unsigned long cpu_mask);
+
+// Per-thread values with optional destructors run by thread_exit. Plain
+// __thread variables work as well since every thread gets its own TLS.
+int thread_key_create(thread_key_t *key, void (*destructor)(void *));
+int thread_key_delete(thread_key_t key);
+void *thread_getspecific(thread_key_t key);
+int thread_setspecific(thread_key_t key, const void *value);
+
+// Joined stacks/TCBs are kept for reuse up to a high-water mark
+void thread_cache_set_max(int max);
+int thread_cache_prefill(int count);
+
+// Futex-based synchronization (sync.c)
+void thread_mutex_init(thread_mutex_t *m);
+int thread_mutex_lock(thread_mutex_t *m);
+int thread_mutex_trylock(thread_mutex_t *m);
+int thread_mutex_unlock(thread_mutex_t *m);
+
+void thread_cond_init(thread_cond_t *c);
+int thread_cond_wait(thread_cond_t *c, thread_mutex_t *m);
+int thread_cond_signal(thread_cond_t *c);
+int thread_cond_broadcast(thread_cond_t *c);
+
+void thread_rwlock_init(thread_rwlock_t *rw);
+int thread_rwlock_rdlock(thread_rwlock_t *rw);
+int thread_rwlock_wrlock(thread_rwlock_t *rw);
+int thread_rwlock_unlock(thread_rwlock_t *rw);
+
+// thread_barrier_wait returns 1 in exactly one thread per phase, 0 in the rest
+int thread_barrier_init(thread_barrier_t *b, int count);
+int thread_barrier_wait(thread_barrier_t *b);
+
+int thread_sem_init(thread_sem_t *s, int value);
+int thread_sem_wait(thread_sem_t *s);
+int thread_sem_trywait(thread_sem_t *s);
+int thread_sem_post(thread_sem_t *s);
+
+// Bounded lock-free multi-producer multi-consumer queue (queue.c).
+// capacity is rounded up to a power of two. push fails when the queue is
+// full and pop when it is empty; neither blocks.
+int thread_queue_init(thread_queue_t *q, unsigned long capacity);
+void thread_queue_destroy(thread_queue_t *q);
+int thread_queue_push(thread_queue_t *q, void *item);
+int thread_queue_pop(thread_queue_t *q, void **item);
+
+// Work-stealing pool of thread_create() workers (pool.c). nworkers <= 0
+// means one per online CPU. Tasks may submit further tasks; pool_wait
+// must be called from outside the pool and returns once all are done.
+thread_pool_t *pool_create(int nworkers);
+int pool_submit(thread_pool_t *pool, void (*fn)(void *), void *arg);
+void pool_wait(thread_pool_t *pool);
+void pool_destroy(thread_pool_t *pool);
+
+// M:N user threads multiplexed over nworkers kernel threads (uthread.c).
+// thread_yield switches in user space when called from a uthread and
+// falls back to sched_yield otherwise. The uthread mutex/cond may only be
+// used from uthreads; uthread_join works from anywhere.
+int uthread_init(int nworkers);
+void uthread_shutdown(void);
+int uthread_create(uthread_t **thread, void *(*start_routine)(void *), void *arg);
+int uthread_join(uthread_t *thread, void **retval);
+void thread_yield(void);
+
+void uthread_mutex_init(uthread_mutex_t *m);
+int uthread_mutex_lock(uthread_mutex_t *m);
+int uthread_mutex_unlock(uthread_mutex_t *m);
+void uthread_cond_init(uthread_cond_t *c);
+int uthread_cond_wait(uthread_cond_t *c, uthread_mutex_t *m);
+int uthread_cond_signal(uthread_cond_t *c);
+int uthread_cond_broadcast(uthread_cond_t *c);
 
 #endif
 
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+#include "thread.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * M:N mode: user threads with small stacks multiplexed over a few
+ * thread_create() workers. A switch is a hand-written save/restore of the
+ * callee-saved registers and the stack pointer, so yielding or blocking on
+ * a uthread primitive never enters the kernel (MXCSR and the x87 control
+ * word are shared, uthreads must not change them). The uthread being switched
+ * away from is only requeued/unlocked/retired by its worker after the
+ * switch, once nothing is running on its stack any more.
+ */
+
+enum { UT_RUNNABLE, UT_RUNNING, UT_BLOCKED, UT_DONE };
+enum { POST_NONE, POST_REQUEUE, POST_UNLOCK, POST_EXIT };
+
+struct uthread {
+    void *sp;
+    void *stack;
+    void *(*fn)(void *);
+    void *arg;
+    void *retval;
+    int state;
+    int lock;
+    int done;  // futex word for joiners outside the scheduler
+    struct uthread *joiner;
+    struct uthread *next;
+};
+
+typedef struct {
+    void *sched_sp;
+    uthread_t *current;
+    int post;
+    int *post_lock;
+    thread_t tid;
+} uworker_t;
+
+static uworker_t *uworkers;
+static int nuworkers;
+
+static int rq_lock;
+static uthread_t *rq_head, *rq_tail;
+static int rq_seq, rq_sleepers, rq_waking, rq_stop;
+
+void uctx_switch(void **save_sp, void *next_sp);
+void uctx_trampoline(void);
+
+__asm__(
+    ".text\n"
+    ".globl uctx_switch\n"
+    ".type uctx_switch, @function\n"
+    "uctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size uctx_switch, .-uctx_switch\n"
+    // first switch into a uthread lands here with the uthread in r12
+    ".globl uctx_trampoline\n"
+    ".type uctx_trampoline, @function\n"
+    "uctx_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    call uthread_entry\n"
+    "    ud2\n"
+    ".size uctx_trampoline, .-uctx_trampoline\n");
+
+static void futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void spin_lock(int *l) {
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(l, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+}
+
+static void spin_unlock(int *l) {
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+static uworker_t *current_worker() {
+    tcb_t *self = thread_current();
+    return self ? self->uthread_worker : NULL;
+}
+
+static void rq_push(uthread_t *u) {
+    u->state = UT_RUNNABLE;
+    u->next = NULL;
+
+    spin_lock(&rq_lock);
+    if (rq_tail) {
+        rq_tail->next = u;
+    } else {
+        rq_head = u;
+    }
+    rq_tail = u;
+    spin_unlock(&rq_lock);
+
+    // same single-claim wakeup as the thread pool
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rq_sleepers, __ATOMIC_SEQ_CST) != 0 &&
+        !__atomic_exchange_n(&rq_waking, 1, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(&rq_seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&rq_seq, 1);
+    }
+}
+
+static uthread_t *rq_pop() {
+    if (!__atomic_load_n(&rq_head, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    spin_lock(&rq_lock);
+    uthread_t *u = rq_head;
+    if (u) {
+        rq_head = u->next;
+        if (!rq_head) {
+            rq_tail = NULL;
+        }
+    }
+    spin_unlock(&rq_lock);
+    return u;
+}
+
+// Leave the running uthread and return to the worker's scheduler loop,
+// which performs `post` once we are off this stack.
+static void schedule(int post, int *lock) {
+    uworker_t *w = current_worker();
+    uthread_t *u = w->current;
+
+    w->post = post;
+    w->post_lock = lock;
+    uctx_switch(&u->sp, w->sched_sp);
+}
+
+void uthread_entry(uthread_t *u) {
+    u->retval = u->fn(u->arg);
+    schedule(POST_EXIT, NULL);
+}
+
+static void retire(uthread_t *u) {
+    spin_lock(&u->lock);
+    u->state = UT_DONE;
+    uthread_t *joiner = u->joiner;
+    spin_unlock(&u->lock);
+
+    if (joiner) {
+        rq_push(joiner);
+    }
+    // last touch of u: joiners free it as soon as they see done
+    __atomic_store_n(&u->done, 1, __ATOMIC_RELEASE);
+    futex_wake(&u->done, INT_MAX);
+}
+
+static void *uworker_main(void *arg) {
+    uworker_t *w = (uworker_t *)arg;
+
+    thread_current()->uthread_worker = w;
+
+    while (1) {
+        uthread_t *u = rq_pop();
+        if (!u) {
+            __atomic_fetch_add(&rq_sleepers, 1, __ATOMIC_SEQ_CST);
+            int seq = __atomic_load_n(&rq_seq, __ATOMIC_SEQ_CST);
+            u = rq_pop();
+            if (!u && !__atomic_load_n(&rq_stop, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&rq_waking, 0, __ATOMIC_RELEASE);
+                futex_wait(&rq_seq, seq);
+            }
+            __atomic_fetch_sub(&rq_sleepers, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&rq_waking, 0, __ATOMIC_RELEASE);
+            if (!u) {
+                if (__atomic_load_n(&rq_stop, __ATOMIC_ACQUIRE)) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        w->current = u;
+        u->state = UT_RUNNING;
+        uctx_switch(&w->sched_sp, u->sp);
+        w->current = NULL;
+
+        switch (w->post) {
+        case POST_REQUEUE:
+            rq_push(u);
+            break;
+        case POST_UNLOCK:
+            spin_unlock(w->post_lock);
+            break;
+        case POST_EXIT:
+            retire(u);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int uthread_init(int nworkers) {
+    if (nworkers <= 0) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    uworkers = calloc(nworkers, sizeof(uworker_t));
+    if (!uworkers) {
+        return -1;
+    }
+    rq_stop = 0;
+    for (nuworkers = 0; nuworkers < nworkers; nuworkers++) {
+        if (thread_create(&uworkers[nuworkers].tid, uworker_main, &uworkers[nuworkers]) != 0) {
+            uthread_shutdown();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void uthread_shutdown() {
+    __atomic_store_n(&rq_stop, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&rq_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&rq_seq, INT_MAX);
+
+    for (int i = 0; i < nuworkers; i++) {
+        thread_join(uworkers[i].tid, NULL);
+    }
+    free(uworkers);
+    uworkers = NULL;
+    nuworkers = 0;
+}
+
+int uthread_create(uthread_t **thread, void *(*start_routine)(void *), void *arg) {
+    char *stack = mmap(NULL, UTHREAD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        return -1;
+    }
+    if (mprotect(stack, THREAD_GUARD_SIZE, PROT_NONE) != 0) {
+        munmap(stack, UTHREAD_STACK_SIZE);
+        return -1;
+    }
+
+    // the uthread lives at the top of its stack, like the 1:1 TCB
+    uthread_t *u = (uthread_t *)(((unsigned long)stack + UTHREAD_STACK_SIZE - sizeof(uthread_t)) & ~63UL);
+    u->stack = stack;
+    u->fn = start_routine;
+    u->arg = arg;
+    u->retval = NULL;
+    u->lock = 0;
+    u->done = 0;
+    u->joiner = NULL;
+
+    // initial frame popped by uctx_switch: r15 r14 r13 r12 rbx rbp, then
+    // return into the trampoline with rsp 16-byte aligned for its call
+    void **frame = (void **)(((unsigned long)u & ~15UL) - 9 * sizeof(void *));
+    for (int i = 0; i < 6; i++) {
+        frame[i] = NULL;
+    }
+    frame[3] = u;
+    frame[6] = (void *)uctx_trampoline;
+    u->sp = frame;
+
+    *thread = u;
+    rq_push(u);
+    return 0;
+}
+
+int uthread_join(uthread_t *u, void **retval) {
+    uworker_t *w = current_worker();
+
+    if (w && w->current) {
+        spin_lock(&u->lock);
+        if (u->state != UT_DONE) {
+            if (u->joiner) {
+                spin_unlock(&u->lock);
+                return -1;
+            }
+            u->joiner = w->current;
+            w->current->state = UT_BLOCKED;
+            schedule(POST_UNLOCK, &u->lock);
+        } else {
+            spin_unlock(&u->lock);
+        }
+    }
+
+    // brief once rescheduled above; a real sleep for callers outside M:N
+    int done;
+    while ((done = __atomic_load_n(&u->done, __ATOMIC_ACQUIRE)) == 0) {
+        futex_wait(&u->done, done);
+    }
+
+    if (retval) {
+        *retval = u->retval;
+    }
+    munmap(u->stack, UTHREAD_STACK_SIZE);
+    return 0;
+}
+
+void thread_yield() {
+    uworker_t *w = current_worker();
+
+    if (!w || !w->current) {
+        sched_yield();
+        return;
+    }
+    schedule(POST_REQUEUE, NULL);
+}
+
+/*
+ * Blocking primitives for uthreads. A waiter queues itself under the
+ * primitive's spinlock and switches away; its worker drops the spinlock
+ * after the switch, so a waker can never requeue it while it is still
+ * running. Ownership of the mutex is handed directly to the woken waiter.
+ */
+void uthread_mutex_init(uthread_mutex_t *m) {
+    m->lock = 0;
+    m->locked = 0;
+    m->head = m->tail = NULL;
+}
+
+static void wait_enqueue(uthread_t **head, uthread_t **tail, uthread_t *u) {
+    u->next = NULL;
+    u->state = UT_BLOCKED;
+    if (*tail) {
+        (*tail)->next = u;
+    } else {
+        *head = u;
+    }
+    *tail = u;
+}
+
+static uthread_t *wait_dequeue(uthread_t **head, uthread_t **tail) {
+    uthread_t *u = *head;
+    if (u) {
+        *head = u->next;
+        if (!*head) {
+            *tail = NULL;
+        }
+    }
+    return u;
+}
+
+int uthread_mutex_lock(uthread_mutex_t *m) {
+    spin_lock(&m->lock);
+    if (!m->locked) {
+        m->locked = 1;
+        spin_unlock(&m->lock);
+        return 0;
+    }
+    wait_enqueue(&m->head, &m->tail, current_worker()->current);
+    schedule(POST_UNLOCK, &m->lock);
+    return 0;
+}
+
+int uthread_mutex_unlock(uthread_mutex_t *m) {
+    spin_lock(&m->lock);
+    uthread_t *next = wait_dequeue(&m->head, &m->tail);
+    if (!next) {
+        m->locked = 0;
+    }
+    spin_unlock(&m->lock);
+
+    if (next) {
+        rq_push(next);
+    }
+    return 0;
+}
+
+void uthread_cond_init(uthread_cond_t *c) {
+    c->lock = 0;
+    c->head = c->tail = NULL;
+}
+
+int uthread_cond_wait(uthread_cond_t *c, uthread_mutex_t *m) {
+    spin_lock(&c->lock);
+    wait_enqueue(&c->head, &c->tail, current_worker()->current);
+    uthread_mutex_unlock(m);
+    schedule(POST_UNLOCK, &c->lock);
+    return uthread_mutex_lock(m);
+}
+
+int uthread_cond_signal(uthread_cond_t *c) {
+    spin_lock(&c->lock);
+    uthread_t *u = wait_dequeue(&c->head, &c->tail);
+    spin_unlock(&c->lock);
+
+    if (u) {
+        rq_push(u);
+    }
+    return 0;
+}
+
+int uthread_cond_broadcast(uthread_cond_t *c) {
+    spin_lock(&c->lock);
+    uthread_t *u = c->head;
+    c->head = c->tail = NULL;
+    spin_unlock(&c->lock);
+
+    while (u) {
+        uthread_t *next = u->next;
+        rq_push(u);
+        u = next;
+    }
+    return 0;
+}
@@ -0,0 +1,465 @@
+/*
+Read-only view of an ext2 image, shared by inodenumber.c and the block and
+group descriptor tools in Lab Tasks/9. The image (a file or a block device)
+is mmapped once by ext2_open(); the accessors below return pointers into
+the mapping, so looking at an inode, a group descriptor or a block is
+pointer arithmetic instead of an lseek() and a read().
+
+Every accessor checks its argument against the image and returns 0 when it
+is out of range, so a corrupt image cannot make a tool read past the end of
+the mapping. Fields are little-endian on disk and used as they are, which
+is fine on the little-endian machines these tools run on.
+*/
+
+#ifndef EXT2IMG_H
+#define EXT2IMG_H
+
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+
+#define EXT2_SUPER_OFFSET 1024
+#define EXT2_SUPER_MAGIC  0xEF53
+#define EXT2_ROOT_INO     2
+#define EXT2_N_BLOCKS     15
+
+struct ext2_super_block {
+    uint32_t s_inodes_count;
+    uint32_t s_blocks_count;
+    uint32_t s_r_blocks_count;
+    uint32_t s_free_blocks_count;
+    uint32_t s_free_inodes_count;
+    uint32_t s_first_data_block;
+    uint32_t s_log_block_size;
+    uint32_t s_log_frag_size;
+    uint32_t s_blocks_per_group;
+    uint32_t s_frags_per_group;
+    uint32_t s_inodes_per_group;
+    uint32_t s_mtime;
+    uint32_t s_wtime;
+    uint16_t s_mnt_count;
+    uint16_t s_max_mnt_count;
+    uint16_t s_magic;
+    uint16_t s_state;
+    uint16_t s_errors;
+    uint16_t s_minor_rev_level;
+    uint32_t s_lastcheck;
+    uint32_t s_checkinterval;
+    uint32_t s_creator_os;
+    uint32_t s_rev_level;
+    uint16_t s_def_resuid;
+    uint16_t s_def_resgid;
+    uint32_t s_first_ino;
+    uint16_t s_inode_size;
+    uint16_t s_block_group_nr;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];
+    uint8_t  s_volume_name[16];
+    uint8_t  s_last_mounted[64];
+    uint32_t s_algorithm_usage_bitmap;
+    uint8_t  s_prealloc_blocks;
+    uint8_t  s_prealloc_dir_blocks;
+    uint16_t s_reserved_gdt_blocks;  //kept free after the descriptor table for resizing
+};
+
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_RESIZE_INO   7
+#define EXT2_DIND_BLOCK   13
+
+struct ext2_group_desc {
+    uint32_t bg_block_bitmap;
+    uint32_t bg_inode_bitmap;
+    uint32_t bg_inode_table;
+    uint16_t bg_free_blocks_count;
+    uint16_t bg_free_inodes_count;
+    uint16_t bg_used_dirs_count;
+    uint16_t bg_pad;
+    uint8_t  bg_reserved[12];
+};
+
+struct ext2_inode {
+    uint16_t i_mode;
+    uint16_t i_uid;
+    uint32_t i_size;
+    uint32_t i_atime;
+    uint32_t i_ctime;
+    uint32_t i_mtime;
+    uint32_t i_dtime;
+    uint16_t i_gid;
+    uint16_t i_links_count;
+    uint32_t i_blocks;           //in 512-byte sectors
+    uint32_t i_flags;
+    uint32_t i_osd1;
+    uint32_t i_block[EXT2_N_BLOCKS];
+    uint32_t i_generation;
+    uint32_t i_file_acl;
+    uint32_t i_size_high;        //i_dir_acl in revision 0
+    uint32_t i_faddr;
+    uint8_t  i_osd2[12];
+};
+
+//with the filetype feature, which mke2fs turns on for ext2 by default
+struct ext2_dir_entry_2 {
+    uint32_t inode;              //0 for an unused entry
+    uint16_t rec_len;
+    uint8_t  name_len;
+    uint8_t  file_type;
+    char     name[];
+};
+
+typedef struct {
+    const unsigned char *map;
+    unsigned long size;
+    const struct ext2_super_block *sb;
+    const struct ext2_group_desc *gd;    //the whole descriptor table
+    unsigned long block_size;
+    unsigned int inode_size;
+    unsigned int groups;
+} ext2_t;
+
+//Maps the image at path. Returns 0, -1 if it cannot be opened or mapped
+//(errno says why) or -2 if it is not an ext2 file system.
+static inline int ext2_open(ext2_t *fs, const char *path){
+    const struct ext2_super_block *sb;
+    long size;
+    void *map;
+    int fd;
+
+    if((fd=open(path, O_RDONLY))<0) return -1;
+    //lseek() rather than fstat() so block devices get their real size
+    if((size=lseek(fd, 0, SEEK_END))<0){
+        close(fd);
+        return -1;
+    }
+    if(size<EXT2_SUPER_OFFSET+(long)sizeof(struct ext2_super_block)){
+        close(fd);
+        return -2;
+    }
+    map=mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map==MAP_FAILED) return -1;
+
+    sb=(const struct ext2_super_block *)((const char *)map+EXT2_SUPER_OFFSET);
+    fs->map=map;
+    fs->size=size;
+    fs->sb=sb;
+    if(sb->s_magic!=EXT2_SUPER_MAGIC || sb->s_log_block_size>6 || !sb->s_blocks_per_group
+       || !sb->s_inodes_per_group){
+        munmap(map, size);
+        return -2;
+    }
+    fs->block_size=1024UL<<sb->s_log_block_size;
+    fs->inode_size=sb->s_rev_level ? sb->s_inode_size : 128;
+    fs->groups=(sb->s_blocks_count-sb->s_first_data_block+sb->s_blocks_per_group-1)/sb->s_blocks_per_group;
+    //the descriptor table starts in the block after the superblock
+    fs->gd=(const struct ext2_group_desc *)(fs->map+(sb->s_first_data_block+1)*fs->block_size);
+    if(fs->inode_size<128 || (sb->s_first_data_block+1)*fs->block_size
+       +fs->groups*sizeof(struct ext2_group_desc)>fs->size){
+        munmap(map, size);
+        return -2;
+    }
+    return 0;
+}
+
+static inline void ext2_close(ext2_t *fs){
+    munmap((void *)fs->map, fs->size);
+    fs->map=0;
+}
+
+//block blk of the image, block_size bytes
+static inline const unsigned char *ext2_block(const ext2_t *fs, unsigned long blk){
+    if(blk>=fs->size/fs->block_size) return 0;
+    return fs->map+blk*fs->block_size;
+}
+
+static inline const struct ext2_group_desc *ext2_group(const ext2_t *fs, unsigned long g){
+    return g<fs->groups ? &fs->gd[g] : 0;
+}
+
+//inode number ino, counting from 1
+static inline const struct ext2_inode *ext2_inode(const ext2_t *fs, unsigned long ino){
+    const struct ext2_group_desc *gd;
+    unsigned long index, off;
+
+    if(ino<1 || ino>fs->sb->s_inodes_count) return 0;
+    if(!(gd=ext2_group(fs, (ino-1)/fs->sb->s_inodes_per_group))) return 0;
+    index=(ino-1)%fs->sb->s_inodes_per_group;
+    off=gd->bg_inode_table*fs->block_size+index*fs->inode_size;
+    if(off+fs->inode_size>fs->size) return 0;
+    return (const struct ext2_inode *)(fs->map+off);
+}
+
+//size in bytes; only regular files use the high 32 bits
+static inline unsigned long ext2_size(const struct ext2_inode *in){
+    unsigned long size=in->i_size;
+    if((in->i_mode&0170000)==0100000) size|=(unsigned long)in->i_size_high<<32;
+    return size;
+}
+
+//Called with the data blocks of an inode in file order: count blocks
+//starting at physical block blk, or a hole of count blocks if blk is 0.
+//A nonzero return stops the walk.
+typedef int (*ext2_run_fn)(void *arg, unsigned long blk, unsigned long count);
+
+typedef struct {
+    const ext2_t *fs;
+    ext2_run_fn fn, meta;
+    void *arg;
+    unsigned long left;          //blocks of the file not reached yet
+    unsigned long start, count;  //run waiting to be reported
+    int ret;
+} ext2_walk_t;
+
+static inline void ext2_walk_add(ext2_walk_t *w, unsigned long blk, unsigned long n){
+    if(n>w->left) n=w->left;
+    w->left-=n;
+    if(w->count && (blk ? w->start && w->start+w->count==blk : !w->start)){
+        w->count+=n;
+        return;
+    }
+    if(w->count && (w->ret=w->fn(w->arg, w->start, w->count))) return;
+    w->start=blk;
+    w->count=n;
+}
+
+//blk is a data block at depth 0 and an indirect block of that many levels
+//otherwise. A 0 pointer at any level is a hole over its whole subtree.
+static inline void ext2_walk(ext2_walk_t *w, unsigned long blk, int depth){
+    unsigned long per=w->fs->block_size/4, span=1;
+    const uint32_t *p;
+
+    for(int d=0; d<depth; d++) span*=per;
+    if(!blk){
+        ext2_walk_add(w, 0, span);
+        return;
+    }
+    if(!(p=(const uint32_t *)ext2_block(w->fs, blk))){
+        w->ret=-1;
+        return;
+    }
+    if(depth==0){
+        ext2_walk_add(w, blk, 1);
+        return;
+    }
+    if(w->meta && (w->ret=w->meta(w->arg, blk, 1))) return;
+    for(unsigned long i=0; i<per && w->left && !w->ret; i++) ext2_walk(w, p[i], depth-1);
+}
+
+//Like ext2_runs(), and also calls meta, if not 0, with each indirect block
+//the walk goes through
+static inline int ext2_blocks(const ext2_t *fs, const struct ext2_inode *in, ext2_run_fn fn,
+                              ext2_run_fn meta, void *arg){
+    ext2_walk_t w={fs, fn, meta, arg, (ext2_size(in)+fs->block_size-1)/fs->block_size, 0, 0, 0};
+
+    if(!in->i_blocks) return 0;
+    for(int i=0; i<EXT2_N_BLOCKS && w.left && !w.ret; i++)
+        ext2_walk(&w, in->i_block[i], i<12 ? 0 : i-11);
+    if(!w.ret && w.count) w.ret=fn(arg, w.start, w.count);
+    return w.ret;
+}
+
+//Reports the data of inode in as runs of physically contiguous blocks,
+//following the single, double and triple indirect blocks, so the caller
+//can move each run with one system call. Returns 0, -1 if a block pointer
+//is outside the image, or the nonzero value fn stopped with. Fast
+//symlinks (target stored in i_block, i_blocks 0) have no data blocks.
+static inline int ext2_runs(const ext2_t *fs, const struct ext2_inode *in, ext2_run_fn fn, void *arg){
+    return ext2_blocks(fs, in, fn, 0, arg);
+}
+
+static inline int ext2_is_dir(const struct ext2_inode *in){
+    return (in->i_mode&0170000)==0040000;
+}
+
+//Called for each used entry of a directory; a nonzero return stops the
+//scan and is returned by ext2_dir_each()
+typedef int (*ext2_dirent_fn)(void *arg, const struct ext2_dir_entry_2 *de);
+
+typedef struct {
+    const ext2_t *fs;
+    ext2_dirent_fn fn;
+    void *arg;
+} ext2_dir_walk_t;
+
+static inline int ext2_dir_run(void *arg, unsigned long blk, unsigned long count){
+    ext2_dir_walk_t *w=arg;
+    unsigned long bs=w->fs->block_size;
+    const unsigned char *p;
+    int r;
+
+    if(!blk) return 0;
+    for(unsigned long b=0; b<count; b++){
+        if(!(p=ext2_block(w->fs, blk+b))) return -1;
+        //entries never cross a block; stop at the first one that is damaged
+        for(unsigned long off=0; off+8<=bs; ){
+            const struct ext2_dir_entry_2 *de=(const struct ext2_dir_entry_2 *)(p+off);
+            if(de->rec_len<8 || off+de->rec_len>bs || de->name_len+8>de->rec_len) break;
+            if(de->inode && (r=w->fn(w->arg, de))) return r;
+            off+=de->rec_len;
+        }
+    }
+    return 0;
+}
+
+static inline int ext2_dir_each(const ext2_t *fs, const struct ext2_inode *dir, ext2_dirent_fn fn, void *arg){
+    ext2_dir_walk_t w={fs, fn, arg};
+    return ext2_runs(fs, dir, ext2_dir_run, &w);
+}
+
+typedef struct {
+    const char *name;
+    unsigned long len;
+    uint32_t ino;
+} ext2_find_t;
+
+static inline int ext2_find_one(void *arg, const struct ext2_dir_entry_2 *de){
+    ext2_find_t *f=arg;
+    if(de->name_len!=f->len || memcmp(de->name, f->name, f->len)) return 0;
+    f->ino=de->inode;
+    return 1;
+}
+
+//inode of name in directory dir by scanning its blocks, or 0
+static inline uint32_t ext2_lookup(const ext2_t *fs, uint32_t dir, const char *name, unsigned long len){
+    const struct ext2_inode *in=ext2_inode(fs, dir);
+    ext2_find_t f={name, len, 0};
+
+    if(!in || !ext2_is_dir(in) || ext2_dir_each(fs, in, ext2_find_one, &f)<=0) return 0;
+    return f.ino;
+}
+
+//Directory entry cache. The first lookup in a directory reads the whole
+//directory once and puts every entry in a hash table keyed by (directory,
+//name); later lookups there, hits and misses alike, are one probe, so
+//large directories and batches of paths sharing directories never scan
+//the same blocks twice. Names point into the mapping of the image.
+typedef struct {
+    const char *name;
+    uint32_t parent, ino;        //ino 0: free slot
+    uint32_t hash;
+    uint8_t len;
+} ext2_dentry_t;
+
+typedef struct {
+    const ext2_t *fs;
+    ext2_dentry_t *slot;
+    unsigned long cap, used;
+    uint32_t *dirs;              //directories already read, 0 is free
+    unsigned long dirs_cap, dirs_used;
+    uint32_t loading;            //directory being read in
+    int err;                     //out of memory; lookups fall back to scanning
+} ext2_dcache_t;
+
+static inline void ext2_dcache_init(ext2_dcache_t *dc, const ext2_t *fs){
+    memset(dc, 0, sizeof(*dc));
+    dc->fs=fs;
+}
+
+static inline void ext2_dcache_free(ext2_dcache_t *dc){
+    free(dc->slot);
+    free(dc->dirs);
+    ext2_dcache_init(dc, dc->fs);
+}
+
+static inline uint32_t ext2_dhash(uint32_t parent, const char *name, unsigned long len){
+    uint32_t h=2166136261u^parent*2654435761u;
+    for(unsigned long i=0; i<len; i++) h=(h^(unsigned char)name[i])*16777619u;
+    return h;
+}
+
+static inline ext2_dentry_t *ext2_dslot(ext2_dentry_t *slot, unsigned long cap, uint32_t parent,
+                                        const char *name, unsigned long len, uint32_t h){
+    unsigned long i=h&(cap-1);
+    for(; slot[i].ino; i=(i+1)&(cap-1))
+        if(slot[i].hash==h && slot[i].parent==parent && slot[i].len==len && !memcmp(slot[i].name, name, len))
+            break;
+    return &slot[i];
+}
+
+static inline int ext2_dcache_add(void *arg, const struct ext2_dir_entry_2 *de){
+    ext2_dcache_t *dc=arg;
+    uint32_t parent=dc->loading;
+    uint32_t h=ext2_dhash(parent, de->name, de->name_len);
+    ext2_dentry_t *e;
+
+    if(2*(dc->used+1)>dc->cap){
+        unsigned long cap=dc->cap*2;
+        ext2_dentry_t *slot=calloc(cap, sizeof(ext2_dentry_t));
+        if(!slot) return dc->err=-1;
+        for(unsigned long i=0; i<dc->cap; i++)
+            if(dc->slot[i].ino)
+                *ext2_dslot(slot, cap, dc->slot[i].parent, dc->slot[i].name, dc->slot[i].len, dc->slot[i].hash)=dc->slot[i];
+        free(dc->slot);
+        dc->slot=slot;
+        dc->cap=cap;
+    }
+    e=ext2_dslot(dc->slot, dc->cap, parent, de->name, de->name_len, h);
+    if(!e->ino) dc->used++;
+    *e=(ext2_dentry_t){de->name, parent, de->inode, h, de->name_len};
+    return 0;
+}
+
+//reads directory dir into the cache unless it is there already
+static inline int ext2_dcache_load(ext2_dcache_t *dc, uint32_t dir){
+    const struct ext2_inode *in;
+    unsigned long i;
+
+    if(!dc->slot){
+        dc->cap=1024;
+        if(!(dc->slot=calloc(dc->cap, sizeof(ext2_dentry_t)))) return dc->err=-1;
+    }
+    if(2*(dc->dirs_used+1)>dc->dirs_cap){
+        unsigned long cap=dc->dirs_cap ? dc->dirs_cap*2 : 256;
+        uint32_t *dirs=calloc(cap, sizeof(uint32_t));
+        if(!dirs) return dc->err=-1;
+        for(i=0; i<dc->dirs_cap; i++)
+            if(dc->dirs[i]){
+                unsigned long j=dc->dirs[i]*2654435761u&(cap-1);
+                while(dirs[j]) j=(j+1)&(cap-1);
+                dirs[j]=dc->dirs[i];
+            }
+        free(dc->dirs);
+        dc->dirs=dirs;
+        dc->dirs_cap=cap;
+    }
+    for(i=dir*2654435761u&(dc->dirs_cap-1); dc->dirs[i]; i=(i+1)&(dc->dirs_cap-1))
+        if(dc->dirs[i]==dir) return 0;
+    if(!(in=ext2_inode(dc->fs, dir)) || !ext2_is_dir(in)) return -1;
+    dc->loading=dir;
+    if(ext2_dir_each(dc->fs, in, ext2_dcache_add, dc)<0 || dc->err) return -1;
+    dc->dirs[i]=dir;
+    dc->dirs_used++;
+    return 0;
+}
+
+//inode of name in directory dir, or 0
+static inline uint32_t ext2_dcache_lookup(ext2_dcache_t *dc, uint32_t dir, const char *name, unsigned long len){
+    if(dc->err) return ext2_lookup(dc->fs, dir, name, len);
+    if(len>255 || ext2_dcache_load(dc, dir)<0)
+        return dc->err ? ext2_lookup(dc->fs, dir, name, len) : 0;
+    return ext2_dslot(dc->slot, dc->cap, dir, name, len, ext2_dhash(dir, name, len))->ino;
+}
+
+//Inode of an absolute path such as "/a/b/c", or 0 if it does not exist.
+//Empty components are skipped; "." and ".." are looked up like any other
+//name. Uses the cache dc if it is not 0.
+static inline uint32_t ext2_namei(const ext2_t *fs, ext2_dcache_t *dc, const char *path){
+    uint32_t ino=EXT2_ROOT_INO;
+    const char *end;
+
+    for(;;){
+        while(*path=='/') path++;
+        if(!*path) return ino;
+        for(end=path; *end && *end!='/'; end++);
+        ino=dc ? ext2_dcache_lookup(dc, ino, path, end-path) : ext2_lookup(fs, ino, path, end-path);
+        if(!ino) return 0;
+        path=end;
+    }
+}
+
+#endif
@@ -8,42 +8,1289 @@ which reads a text file, specified as command line argument (argv[1]) and
 reads a word from standard input and
 
 prints all lines from the text file containing given word (here word is a character sequence, it need not be separated with space). See how grep works.
+
+It has since outgrown that: the output still goes out through write() and
+writev() with no stdio, but files are searched through mmap() where they
+can be, large files and directory trees (opendir()/readdir()) are split
+into jobs for a pool of pthreads, and patterns, jobs and results live in
+malloc()ed memory.
 */
 
 #include<unistd.h>
 #include<fcntl.h>
+#include<stdlib.h>
+#include<string.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+#include"trigram.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define HAVE_X86 1
+#endif
 
-#define BUF_SIZE 4096
+#define WORD_SIZE 4096
+#define READ_SIZE (1024*1024)
+#define OUT_IOVS 1024     //writev() limit (IOV_MAX on Linux)
+#define CHUNK_SIZE (16*1024*1024)   //large files are split into jobs this big
+#define WINDOW_PER_WORKER 4         //jobs searched ahead of the output, per worker
+#define HORSPOOL_MIN 8     //without SIMD, patterns this long use Horspool
 
-int main(int argc, char *argv[]){
-    char buf[BUF_SIZE], word[BUF_SIZE], *p, *line;
-    int fd, n, i, word_len=0, in_line=0;
-
-    //Read search word from stdin
-    while ((n=read(0, word+word_len, 1))>0 && word[word_len]!='\n') word_len++;
-    word[word_len]=0;
-
-    //Open file
-    if((fd=open(argv[1], O_RDONLY))<0) return 1;
-
-    //Search file
-    line=buf;
-    while((n=read(fd, buf, BUF_SIZE))>0) {
-        for(p=buf; p<buf+n; p++) {
-            if(!in_line)line=p;
-            if(*p=='\n'){
-                in_line=0;
-                continue;
+typedef const char *(*search_fn)(const char *s, long n, const char *w, long m);
+
+static int same(const char *a, const char *b, long m){
+    while(m>0 && *a==*b) a++, b++, m--;
+    return m==0;
+}
+
+static const char *search_scalar(const char *s, long n, const char *w, long m){
+    for(long i=0; i+m<=n; i++)
+        if(s[i]==w[0] && same(s+i, w, m)) return s+i;
+    return 0;
+}
+
+//Boyer-Moore-Horspool: on a mismatch shift by how far the text byte under
+//the pattern's last position is from the end of the pattern
+static long skip[256];
+
+static void horspool_init(const char *w, long m){
+    for(int c=0; c<256; c++) skip[c]=m;
+    for(long i=0; i<m-1; i++) skip[(unsigned char)w[i]]=m-1-i;
+}
+
+static const char *search_horspool(const char *s, long n, const char *w, long m){
+    unsigned char last=w[m-1];
+    for(long i=0; i+m<=n; i+=skip[(unsigned char)s[i+m-1]])
+        if((unsigned char)s[i+m-1]==last && same(s+i, w, m-1)) return s+i;
+    return 0;
+}
+
+#ifdef HAVE_X86
+//First-and-last-byte filter: compare a block of candidate start positions
+//against w[0] and the matching block m-1 bytes later against w[m-1], and
+//only verify the positions where both agree. Needs m >= 2.
+__attribute__((target("sse2")))
+static const char *search_sse2(const char *s, long n, const char *w, long m){
+    __m128i first=_mm_set1_epi8(w[0]), last=_mm_set1_epi8(w[m-1]);
+    long i=0;
+    for(; i+m-1+16<=n; i+=16){
+        __m128i a=_mm_loadu_si128((const __m128i *)(s+i));
+        __m128i b=_mm_loadu_si128((const __m128i *)(s+i+m-1));
+        unsigned mask=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while(mask){
+            int bit=__builtin_ctz(mask);
+            if(same(s+i+bit+1, w+1, m-2)) return s+i+bit;
+            mask&=mask-1;
+        }
+    }
+    return search_scalar(s+i, n-i, w, m);
+}
+
+__attribute__((target("avx2")))
+static const char *search_avx2(const char *s, long n, const char *w, long m){
+    __m256i first=_mm256_set1_epi8(w[0]), last=_mm256_set1_epi8(w[m-1]);
+    long i=0;
+    for(; i+m-1+32<=n; i+=32){
+        __m256i a=_mm256_loadu_si256((const __m256i *)(s+i));
+        __m256i b=_mm256_loadu_si256((const __m256i *)(s+i+m-1));
+        unsigned mask=_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while(mask){
+            int bit=__builtin_ctz(mask);
+            if(same(s+i+bit+1, w+1, m-2)) return s+i+bit;
+            mask&=mask-1;
+        }
+    }
+    return search_sse2(s+i, n-i, w, m);
+}
+#endif
+
+//A one-byte pattern is just a memchr
+static const char *search_byte(const char *s, long n, const char *w, long m){
+    (void)m;
+    return memchr(s, w[0], n);
+}
+
+//Pick the search routine once per pattern, based on its length and the
+//CPU. Where the vector filter is available it beats Horspool even for long
+//patterns (it checks 16/32 positions per step against Horspool's average
+//skip), so Horspool is the fallback for long patterns without it.
+static search_fn pick_search(const char *w, long m){
+    if(m==1) return search_byte;
+#ifdef HAVE_X86
+    if(m>=2){
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) return search_avx2;
+        if(__builtin_cpu_supports("sse2")) return search_sse2;
+    }
+#endif
+    if(m>=HORSPOOL_MIN){
+        horspool_init(w, m);
+        return search_horspool;
+    }
+    return search_scalar;
+}
+
+static char word[WORD_SIZE];
+static long word_len;
+static search_fn search;
+
+static void *xrealloc(void *p, long n){
+    if(!(p=realloc(p, n))) exit(2);
+    return p;
+}
+
+static void write_all(int fd, const char *s, long n){
+    long w;
+    while(n>0 && (w=write(fd, s, n))>0) s+=w, n-=w;
+}
+
+/*
+ * Multi-pattern mode (-f): all patterns are matched in one pass by an
+ * Aho-Corasick automaton turned into a full DFA. Bytes that occur in no
+ * pattern share one input class, so a row is only as wide as the pattern
+ * alphabet (plus one) instead of 256 entries. Rows are stored as int
+ * offsets into the table, premultiplied by the row width, and an entry is
+ * stored as -offset-1 when its target state ends a pattern, so the inner
+ * loop is one load and one sign test per byte.
+ */
+typedef struct {
+    int nclass;
+    unsigned char cls[256];
+    int *delta;
+    int *hit;             //per state: pattern ending here or in a suffix, or -1
+    char start[256];      //bytes that can begin a pattern, for skipping at the root
+    int nstart;
+    int simd_skip;
+    unsigned char lo_nib[32], hi_nib[32];
+    char **pat;
+    long *pat_len;
+    int npat;
+} ac_t;
+
+static ac_t *ac;
+
+/*
+ * In the root state only a byte that starts some pattern can change the
+ * state, so the search skips ahead to the next such byte. With AVX2 the
+ * set test is done 32 bytes at a time with two nibble lookups: bit (h&7)
+ * of lo_nib[l] is set for every start byte with high nibble h and low
+ * nibble l, and hi_nib[h] holds bit (h&7), so a byte passes if the two
+ * lookups share a bit. High nibbles h and h^8 alias, so candidates are
+ * checked against the exact table before the search resumes there. When
+ * many different bytes can start a pattern the skips are too short to pay
+ * for the vector setup, and the plain table loop is used.
+ */
+#define SIMD_SKIP_MAX 8
+
+static void ac_skip_init(ac_t *a){
+    for(int b=0; b<256; b++)
+        if(a->start[b]) a->lo_nib[b&15]|=1<<((b>>4)&7);
+    for(int h=0; h<16; h++) a->hi_nib[h]=1<<(h&7);
+    for(int k=0; k<16; k++){
+        a->lo_nib[16+k]=a->lo_nib[k];
+        a->hi_nib[16+k]=a->hi_nib[k];
+    }
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    a->simd_skip=a->nstart<=SIMD_SKIP_MAX && __builtin_cpu_supports("avx2");
+#endif
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static long ac_skip_avx2(const ac_t *a, const char *s, long n, long i){
+    __m256i lo=_mm256_loadu_si256((const __m256i *)a->lo_nib);
+    __m256i hi=_mm256_loadu_si256((const __m256i *)a->hi_nib);
+    __m256i nib=_mm256_set1_epi8(15), zero=_mm256_setzero_si256();
+
+    for(; i+32<=n; i+=32){
+        __m256i v=_mm256_loadu_si256((const __m256i *)(s+i));
+        __m256i l=_mm256_shuffle_epi8(lo, _mm256_and_si256(v, nib));
+        __m256i h=_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+        unsigned cand=~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(l, h), zero));
+        for(; cand; cand&=cand-1)
+            if(a->start[(unsigned char)s[i+__builtin_ctz(cand)]]) return i+__builtin_ctz(cand);
+    }
+    return i;
+}
+#endif
+
+static long ac_skip(const ac_t *a, const char *s, long n, long i){
+#ifdef HAVE_X86
+    if(a->simd_skip) i=ac_skip_avx2(a, s, n, i);
+#endif
+    while(i<n && !a->start[(unsigned char)s[i]]) i++;
+    return i;
+}
+
+static ac_t *ac_build(char **pat, long *pat_len, int npat){
+    ac_t *a=xrealloc(0, sizeof(ac_t));
+    long total=1, nstates=1;
+    int *fail, *queue, head=0, tail=0;
+
+    memset(a, 0, sizeof(ac_t));
+    a->pat=pat;
+    a->pat_len=pat_len;
+    a->npat=npat;
+    a->nclass=1;
+    for(int i=0; i<npat; i++){
+        total+=pat_len[i];
+        for(long k=0; k<pat_len[i]; k++){
+            unsigned char c=pat[i][k];
+            if(!a->cls[c]) a->cls[c]=a->nclass++;
+        }
+        if(pat_len[i] && !a->start[(unsigned char)pat[i][0]]){
+            a->start[(unsigned char)pat[i][0]]=1;
+            a->nstart++;
+        }
+    }
+    ac_skip_init(a);
+
+    //trie first, with -1 for missing edges
+    int w=a->nclass;
+    a->delta=xrealloc(0, total*w*sizeof(int));
+    a->hit=xrealloc(0, total*sizeof(int));
+    memset(a->delta, -1, total*w*sizeof(int));
+    memset(a->hit, -1, total*sizeof(int));
+    for(int i=0; i<npat; i++){
+        long st=0;
+        for(long k=0; k<pat_len[i]; k++){
+            int *e=&a->delta[st*w+a->cls[(unsigned char)pat[i][k]]];
+            if(*e<0) *e=nstates++;
+            st=*e;
+        }
+        if(a->hit[st]<0) a->hit[st]=i;
+    }
+
+    //breadth first: fill missing edges from the failure state, which is
+    //shallower and therefore already complete
+    fail=xrealloc(0, nstates*sizeof(int));
+    queue=xrealloc(0, nstates*sizeof(int));
+    fail[0]=0;
+    for(int c=0; c<w; c++){
+        int v=a->delta[c];
+        if(v<0) a->delta[c]=0;
+        else fail[v]=0, queue[tail++]=v;
+    }
+    while(head<tail){
+        int u=queue[head++];
+        if(a->hit[u]<0) a->hit[u]=a->hit[fail[u]];
+        for(int c=0; c<w; c++){
+            int v=a->delta[u*w+c];
+            if(v<0) a->delta[u*w+c]=a->delta[fail[u]*w+c];
+            else fail[v]=a->delta[fail[u]*w+c], queue[tail++]=v;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    for(long i=0; i<nstates*w; i++){
+        int v=a->delta[i];
+        a->delta[i]=a->hit[v]>=0 ? -v*w-1 : v*w;
+    }
+    return a;
+}
+
+//Leftmost-ending match in s[0..n); returns its start and the pattern in *hit
+static const char *ac_search(const ac_t *a, const char *s, long n, int *hit){
+    const int *delta=a->delta;
+    const unsigned char *cls=a->cls;
+    int st=0;
+
+    if(a->hit[0]>=0){
+        *hit=a->hit[0];
+        return s;
+    }
+    for(long i=0; i<n; i++){
+        if(st==0 && (i=ac_skip(a, s, n, i))==n) break;
+        st=delta[st+cls[(unsigned char)s[i]]];
+        if(st<0){
+            *hit=a->hit[(-st-1)/a->nclass];
+            return s+i+1-a->pat_len[*hit];
+        }
+    }
+    return 0;
+}
+
+//One pattern per line of fd, kept for the whole run
+static int read_patterns(int fd, char ***pat, long **pat_len){
+    long cap=64*1024, len=0, n;
+    char *buf=xrealloc(0, cap+1);
+    int npat=0;
+
+    while((n=read(fd, buf+len, cap-len))>0)
+        if((len+=n)==cap) buf=xrealloc(buf, (cap*=2)+1);
+    if(len>0 && buf[len-1]!='\n') buf[len++]='\n';
+
+    for(long i=0; i<len; i++) npat+=buf[i]=='\n';
+    *pat=xrealloc(0, (npat+1)*sizeof(char *));
+    *pat_len=xrealloc(0, (npat+1)*sizeof(long));
+    npat=0;
+    for(char *p=buf, *nl; p<buf+len; p=nl+1){
+        nl=memchr(p, '\n', buf+len-p);
+        (*pat)[npat]=p;
+        (*pat_len)[npat++]=nl-p;
+    }
+    return npat;
+}
+
+/*
+ * Regex mode (-E): ^ $ . [...] [^...] * + ? | ( ) and \ escapes. The
+ * pattern is parsed straight into a Thompson NFA and searched with a DFA
+ * that is built lazily, one state per set of NFA states actually seen, so
+ * every input byte costs one table step once the cache is warm and the
+ * search stays linear. Each thread keeps its own DFA cache; when it grows
+ * past DFA_MEM_MAX it is thrown away and rebuilt from the current state.
+ * The longest literal that every match must contain is found up front and
+ * searched for with the fast substring search, so only lines containing it
+ * are run through the DFA.
+ */
+#define DFA_MEM_MAX (8*1024*1024)
+#define DFA_BUCKETS 4096
+
+enum { NS_SET, NS_SPLIT, NS_JMP, NS_BOL, NS_EOL, NS_MATCH };
+
+typedef struct {
+    int op, out, out1;
+    unsigned char set[32];
+} nstate_t;
+
+typedef struct {
+    int start, end;       //end is an NS_JMP whose out is still open
+} frag_t;
+
+static nstate_t *nfa;
+static int nfa_len, nfa_cap, nfa_start;
+static const char *re_src;
+static int re_pos, re_err;
+static unsigned char re_cls[256];
+static int re_nclass;
+static char re_lit[WORD_SIZE];
+static long re_lit_len;
+
+static int nstate(int op, int out, int out1){
+    if(nfa_len==nfa_cap){
+        nfa_cap=nfa_cap ? nfa_cap*2 : 64;
+        nfa=xrealloc(nfa, nfa_cap*sizeof(nstate_t));
+    }
+    memset(&nfa[nfa_len], 0, sizeof(nstate_t));
+    nfa[nfa_len].op=op;
+    nfa[nfa_len].out=out;
+    nfa[nfa_len].out1=out1;
+    return nfa_len++;
+}
+
+static frag_t re_alt();
+
+//A one-byte step; ops other than NS_SET are zero-width assertions
+static frag_t re_single(int op, const unsigned char *set){
+    frag_t f;
+    f.end=nstate(NS_JMP, -1, -1);
+    f.start=nstate(op, f.end, -1);
+    if(set) memcpy(nfa[f.start].set, set, 32);
+    return f;
+}
+
+static int re_escape(int c){
+    return c=='n' ? '\n' : c=='t' ? '\t' : c;
+}
+
+static frag_t re_atom(){
+    unsigned char set[32]={0};
+    int c=(unsigned char)re_src[re_pos++];
+
+    if(c=='('){
+        frag_t f=re_alt();
+        if(re_src[re_pos]!=')') re_err=1;
+        else re_pos++;
+        return f;
+    }
+    if(c=='^') return re_single(NS_BOL, 0);
+    if(c=='$') return re_single(NS_EOL, 0);
+    if(c=='.'){
+        memset(set, 0xff, 32);
+        set['\n'/8]&=~(1<<('\n'%8));
+        return re_single(NS_SET, set);
+    }
+    if(c=='['){
+        int neg=re_src[re_pos]=='^', first=1;
+        if(neg) re_pos++;
+        //a ']' right after '[' or '[^' is literal
+        while(re_src[re_pos] && (first || re_src[re_pos]!=']')){
+            int lo=(unsigned char)re_src[re_pos++], hi;
+            if(lo=='\\' && re_src[re_pos]) lo=re_escape((unsigned char)re_src[re_pos++]);
+            hi=lo;
+            if(re_src[re_pos]=='-' && re_src[re_pos+1] && re_src[re_pos+1]!=']'){
+                hi=(unsigned char)re_src[re_pos+1];
+                re_pos+=2;
+                if(hi=='\\' && re_src[re_pos]) hi=re_escape((unsigned char)re_src[re_pos++]);
             }
-            in_line=1;
-            for(i=0; i<word_len && p+i<buf+n; i++)
-                if(p[i]!=word[i]) break;
-            if(i==word_len){
-                write(1, line, p-line+word_len + 1);
-                p+=word_len-1;
+            for(int b=lo; b<=hi; b++) set[b/8]|=1<<(b%8);
+            first=0;
+        }
+        if(re_src[re_pos]!=']') re_err=1;
+        else re_pos++;
+        if(neg)
+            for(int i=0; i<32; i++) set[i]=~set[i];
+        set['\n'/8]&=~(1<<('\n'%8));
+        return re_single(NS_SET, set);
+    }
+    if(c=='\\' && re_src[re_pos]) c=re_escape((unsigned char)re_src[re_pos++]);
+    set[c/8]|=1<<(c%8);
+    return re_single(NS_SET, set);
+}
+
+static frag_t re_repeat(){
+    frag_t f=re_atom();
+
+    for(char q; (q=re_src[re_pos])=='*' || q=='+' || q=='?'; re_pos++){
+        int end=nstate(NS_JMP, -1, -1);
+        int split=nstate(NS_SPLIT, f.start, end);
+        if(q=='?') nfa[f.end].out=end;
+        else nfa[f.end].out=split;
+        f.start = q=='+' ? f.start : split;
+        f.end=end;
+    }
+    return f;
+}
+
+static frag_t re_concat(){
+    frag_t f;
+    f.start=f.end=nstate(NS_JMP, -1, -1);
+    while(re_src[re_pos] && re_src[re_pos]!='|' && re_src[re_pos]!=')'){
+        frag_t g=re_repeat();
+        nfa[f.end].out=g.start;
+        f.end=g.end;
+    }
+    return f;
+}
+
+static frag_t re_alt(){
+    frag_t f=re_concat();
+    while(re_src[re_pos]=='|'){
+        re_pos++;
+        frag_t g=re_concat();
+        int end=nstate(NS_JMP, -1, -1);
+        f.start=nstate(NS_SPLIT, f.start, g.start);
+        nfa[f.end].out=end;
+        nfa[g.end].out=end;
+        f.end=end;
+    }
+    return f;
+}
+
+//Longest run of plain characters in the top-level concatenation; a match
+//must contain it unless the pattern has a top-level '|'
+static void re_literal(const char *r){
+    char run[WORD_SIZE];
+    long len=0, depth=0;
+
+    re_lit_len=0;
+    for(const char *p=r; *p; ){
+        if(depth==0 && *p=='|'){
+            re_lit_len=0;
+            return;
+        }
+        int c=-1;
+        if(*p=='(') depth++;
+        else if(*p==')') depth--;
+        else if(*p=='\\' && p[1]){
+            if(depth==0) c=re_escape((unsigned char)p[1]);
+            p++;
+        }
+        else if(depth==0 && !strchr("^$.[*+?", *p)) c=(unsigned char)*p;
+        else if(*p=='['){
+            //skip the class, ']' first in it is literal
+            p++;
+            if(*p=='^') p++;
+            if(*p==']') p++;
+            while(*p && *p!=']') p+=(*p=='\\' && p[1]) ? 2 : 1;
+            if(!*p) break;
+        }
+        p++;
+
+        //a quantified character is optional (any * or ?) or ends the run (+)
+        int q=0;
+        for(const char *r=p; *r=='*' || *r=='?' || *r=='+'; r++)
+            if(q!=1) q=*r=='+' ? 2 : 1;
+        if(c>=0 && q!=1 && len<WORD_SIZE-1) run[len++]=c;
+        if(c<0 || q){
+            if(len>re_lit_len) memcpy(re_lit, run, len), re_lit_len=len;
+            len=0;
+        }
+    }
+    if(len>re_lit_len) memcpy(re_lit, run, len), re_lit_len=len;
+}
+
+static int re_compile(const char *r){
+    re_src=r;
+    re_pos=0;
+    re_err=0;
+    frag_t f=re_alt();
+    if(re_err || re_src[re_pos]) return -1;
+    nfa[f.end].out=nstate(NS_MATCH, -1, -1);
+    nfa_start=f.start;
+
+    //bytes that no set tells apart share a class, refined one set at a time
+    int map[512];
+    re_nclass=1;
+    for(int i=0; i<nfa_len; i++){
+        if(nfa[i].op!=NS_SET) continue;
+        int n=0;
+        for(int k=0; k<2*re_nclass; k++) map[k]=-1;
+        for(int b=0; b<256; b++){
+            int k=re_cls[b]*2+((nfa[i].set[b/8]>>(b%8))&1);
+            if(map[k]<0) map[k]=n++;
+            re_cls[b]=map[k];
+        }
+        re_nclass=n;
+    }
+    re_literal(r);
+    return 0;
+}
+
+typedef struct dstate {
+    struct dstate *chain;
+    unsigned hash;
+    int n;
+    char match, match_eol;
+    int *set;                     //sorted NFA states, SET/EOL/MATCH only
+    struct dstate *next[];        //per byte class, 0 until computed
+} dstate_t;
+
+typedef struct {
+    dstate_t *bucket[DFA_BUCKETS];
+    dstate_t *start;              //at the beginning of a line
+    long mem;
+    int flushes;
+    int *stack, *list, *scratch;
+    unsigned *mark, gen;
+} dfa_t;
+
+static __thread dfa_t *dfa;
+
+//Follow the epsilon edges from state s; at_bol says whether ^ holds
+static void re_closure(dfa_t *d, int s, int at_bol, int *list, int *n){
+    int sp=0;
+
+    d->stack[sp++]=s;
+    while(sp>0){
+        s=d->stack[--sp];
+        if(s<0 || d->mark[s]==d->gen) continue;
+        d->mark[s]=d->gen;
+        switch(nfa[s].op){
+        case NS_SPLIT:
+            d->stack[sp++]=nfa[s].out1;
+            d->stack[sp++]=nfa[s].out;
+            break;
+        case NS_JMP:
+            d->stack[sp++]=nfa[s].out;
+            break;
+        case NS_BOL:
+            if(at_bol) d->stack[sp++]=nfa[s].out;
+            break;
+        default:
+            list[(*n)++]=s;
+        }
+    }
+}
+
+static int cmp_int(const void *a, const void *b){
+    return *(const int *)a-*(const int *)b;
+}
+
+static void dfa_flush(dfa_t *d){
+    for(int i=0; i<DFA_BUCKETS; i++){
+        for(dstate_t *s=d->bucket[i], *next; s; s=next){
+            next=s->chain;
+            free(s->set);
+            free(s);
+        }
+        d->bucket[i]=0;
+    }
+    d->start=0;
+    d->mem=0;
+    d->flushes++;
+}
+
+//The cached DFA state for a set of NFA states, created if needed
+static dstate_t *dfa_state(dfa_t *d, int *set, int n){
+    unsigned h=2166136261u;
+    dstate_t *s;
+
+    qsort(set, n, sizeof(int), cmp_int);
+    for(int i=0; i<n; i++) h=(h^set[i])*16777619u;
+    for(s=d->bucket[h%DFA_BUCKETS]; s; s=s->chain)
+        if(s->hash==h && s->n==n && !memcmp(s->set, set, n*sizeof(int))) return s;
+
+    long size=sizeof(dstate_t)+re_nclass*sizeof(dstate_t *)+n*sizeof(int);
+    if(d->mem+size>DFA_MEM_MAX) dfa_flush(d);
+    s=xrealloc(0, sizeof(dstate_t)+re_nclass*sizeof(dstate_t *));
+    memset(s->next, 0, re_nclass*sizeof(dstate_t *));
+    s->set=xrealloc(0, n*sizeof(int)+1);
+    s->hash=h;
+    s->n=n;
+    s->match=0;
+    s->match_eol=0;
+    memcpy(s->set, set, n*sizeof(int));
+
+    //$ only holds right before '\n' or the end, so check it separately
+    int m=0;
+    d->gen++;
+    for(int i=0; i<n; i++){
+        if(nfa[s->set[i]].op==NS_MATCH) s->match=1;
+        if(nfa[s->set[i]].op==NS_EOL) re_closure(d, nfa[s->set[i]].out, 0, d->scratch, &m);
+    }
+    for(int k=0; k<m; k++) s->match_eol|=nfa[d->scratch[k]].op==NS_MATCH;
+    s->match_eol|=s->match;
+
+    s->chain=d->bucket[h%DFA_BUCKETS];
+    d->bucket[h%DFA_BUCKETS]=s;
+    d->mem+=size;
+    return s;
+}
+
+static dfa_t *dfa_get(){
+    if(!dfa){
+        dfa=xrealloc(0, sizeof(dfa_t));
+        memset(dfa, 0, sizeof(dfa_t));
+        dfa->stack=xrealloc(0, 2*nfa_len*sizeof(int)+sizeof(int));
+        dfa->list=xrealloc(0, nfa_len*sizeof(int));
+        dfa->scratch=xrealloc(0, nfa_len*sizeof(int));
+        dfa->mark=xrealloc(0, nfa_len*sizeof(unsigned));
+        memset(dfa->mark, 0, nfa_len*sizeof(unsigned));
+    }
+    if(!dfa->start){
+        int n=0;
+        dfa->gen++;
+        re_closure(dfa, nfa_start, 1, dfa->list, &n);
+        dfa->start=dfa_state(dfa, dfa->list, n);
+    }
+    return dfa;
+}
+
+//Step on byte c: advance every SET state that takes c, and restart the
+//pattern here since a match may begin anywhere in the line
+static dstate_t *dfa_step(dfa_t *d, dstate_t *s, unsigned char c){
+    int n=0, cls=re_cls[c];
+
+    if(s->match) return s->next[cls]=s;
+    d->gen++;
+    for(int i=0; i<s->n; i++){
+        nstate_t *ns=&nfa[s->set[i]];
+        if(ns->op==NS_SET && (ns->set[c/8]>>(c%8)&1)) re_closure(d, ns->out, 0, d->list, &n);
+    }
+    re_closure(d, nfa_start, 0, d->list, &n);
+
+    //if the cache was flushed to make room, s is gone and t starts afresh
+    int flushes=d->flushes;
+    dstate_t *t=dfa_state(d, d->list, n);
+    if(d->flushes==flushes) s->next[cls]=t;
+    return t;
+}
+
+//Does the line [p, end) match?
+static int re_line(const char *p, const char *end){
+    dfa_t *d=dfa_get();
+    dstate_t *s=d->start, *t;
+
+    if(s->match) return 1;
+    //match states only loop back to themselves, so one test at the end of
+    //the line does; the loop carries just the table lookup
+    for(; p<end; p++){
+        if(!(t=s->next[re_cls[(unsigned char)*p]])){
+            t=dfa_step(d, s, *p);
+            if(!d->start) dfa_get();
+        }
+        s=t;
+    }
+    return s->match_eol;
+}
+
+//Start of the first matching line in s[0..n), which holds whole lines
+static const char *re_search(const char *s, long n){
+    const char *end=s+n, *p=s, *line, *eol;
+
+    while(p<end){
+        if(re_lit_len){
+            const char *m=search(p, end-p, re_lit, re_lit_len);
+            if(!m) return 0;
+            for(line=m; line>p && line[-1]!='\n'; line--);
+        } else line=p;
+        eol=memchr(line, '\n', end-line);
+        if(!eol) eol=end;
+        if(re_line(line, eol)) return line;
+        p=eol+1;
+    }
+    return 0;
+}
+
+//Where the matching lines of one input (or one chunk of it) go. Lines are
+//normally not copied: each becomes an iovec pointing into the input (the
+//mapping or the read buffer), and adjacent ones are merged. copy is set
+//when the input will be gone before the lines are written; they are then
+//appended to bytes instead. prefix is "name:" when several files are
+//searched.
+typedef struct {
+    struct iovec *v;
+    int cnt, cap;
+    char *bytes;
+    long len, size;
+    int copy;
+    const char *prefix;
+    long prefix_len;
+} out_t;
+
+static void push_iov(out_t *o, const char *s, long n){
+    if(o->cnt>0 && (char *)o->v[o->cnt-1].iov_base+o->v[o->cnt-1].iov_len==s){
+        o->v[o->cnt-1].iov_len+=n;
+        return;
+    }
+    if(o->cnt==o->cap){
+        o->cap=o->cap ? o->cap*2 : 64;
+        o->v=xrealloc(o->v, o->cap*sizeof(struct iovec));
+    }
+    o->v[o->cnt].iov_base=(void *)s;
+    o->v[o->cnt].iov_len=n;
+    o->cnt++;
+}
+
+static void push_bytes(out_t *o, const char *s, long n){
+    if(o->len+n>o->size){
+        while(o->len+n>o->size) o->size=o->size ? o->size*2 : 64*1024;
+        o->bytes=xrealloc(o->bytes, o->size);
+    }
+    memcpy(o->bytes+o->len, s, n);
+    o->len+=n;
+}
+
+static void emit_raw(out_t *o, const char *s, long n){
+    if(o->copy) push_bytes(o, s, n);
+    else push_iov(o, s, n);
+}
+
+
+//Write out everything queued so far, OUT_IOVS iovecs per writev()
+static void flush_out(out_t *o){
+    struct iovec *v=o->v;
+    int cnt=o->cnt;
+    long w;
+
+    write_all(1, o->bytes, o->len);
+    while(cnt>0 && (w=writev(1, v, cnt<OUT_IOVS ? cnt : OUT_IOVS))>0){
+        while(cnt>0 && (size_t)w>=v->iov_len) w-=v->iov_len, v++, cnt--;
+        if(cnt>0) v->iov_base=(char *)v->iov_base+w, v->iov_len-=w;
+    }
+    o->cnt=0;
+    o->len=0;
+}
+
+static void free_out(out_t *o){
+    free(o->v);
+    free(o->bytes);
+}
+
+//Print every line of s[0..n) containing the word. s holds whole lines only
+//(the last one may lack its '\n' at end of file), so a match never spans
+//two calls.
+static void scan_lines(out_t *o, const char *s, long n){
+    const char *p, *match, *line, *end;
+    long match_len=word_len;
+    int hit;
+
+    for(p=s; p<s+n; p=end+1) {
+        if(ac){
+            if(!(match=ac_search(ac, p, s+n-p, &hit))) break;
+            match_len=ac->pat_len[hit];
+        }
+        else if(nfa){
+            if(!(match=re_search(p, s+n-p))) break;
+            match_len=0;
+        }
+        else if(word_len==0) match=p;
+        else if(!(match=search(p, s+n-p, word, word_len))) break;
+        for(line=match; line>p && line[-1]!='\n'; line--);
+        for(end=match+match_len; end<s+n && *end!='\n'; end++);
+
+        if(o->prefix) emit_raw(o, o->prefix, o->prefix_len);
+        //in -f mode say which pattern hit the line
+        if(ac) emit_raw(o, ac->pat[hit], match_len), emit_raw(o, ":", 1);
+        //like grep, finish a last line that has no '\n' so that the next
+        //file's output does not run into it
+        if(end<s+n) emit_raw(o, line, end-line+1);
+        else emit_raw(o, line, end-line), emit_raw(o, "\n", 1);
+    }
+}
+
+//Pipes, stdin and anything else that cannot be mapped: buf[0..len) starts
+//at a line boundary. Each read appends to it, the complete lines are
+//scanned, and only the unfinished last line is moved to the front for the
+//next round. A line longer than the buffer doubles it.
+static int grep_stream(out_t *o, int fd){
+    long cap=READ_SIZE, len=0, done, n;
+    char *buf=xrealloc(0, cap);
+
+    for(;;) {
+        if(len==cap){
+            cap*=2;
+            buf=xrealloc(buf, cap);
+        }
+        if((n=read(fd, buf+len, cap-len))<=0) break;
+        len+=n;
+
+        //the carried-over part has no '\n', so only the new bytes are looked at
+        for(done=len; done>len-n && buf[done-1]!='\n'; done--);
+        if(done==len-n) done=0;
+        scan_lines(o, buf, done);
+        //queued lines point into buf, so send them before it changes
+        if(!o->copy) flush_out(o);
+        for(long i=done; i<len; i++) buf[i-done]=buf[i];
+        len-=done;
+    }
+    scan_lines(o, buf, len);
+    if(!o->copy) flush_out(o);
+    free(buf);
+    return n<0 ? -1 : 0;
+}
+
+/*
+ * Every input is cut into jobs: a regular file into line-aligned chunks of
+ * about CHUNK_SIZE that are searched straight from one mapping of the
+ * file, anything else into a single job streamed with read(). Workers take jobs in order
+ * and queue their output in the job; the main thread writes the jobs out
+ * strictly in order, so the output is the same as a sequential search.
+ * Workers stay at most a window of jobs ahead of the writer, which bounds
+ * the memory held by finished but unwritten jobs.
+ */
+//A regular file is mapped once, by whichever of its jobs runs first, and
+//unmapped by the writer after the last of its jobs has been written
+typedef struct {
+    const char *path;
+    pthread_mutex_t lock;
+    int mapped, failed;
+    int jobs_left;
+    char *map;
+    long map_len;
+    struct stat st;
+    char *ix;               //the file's .tri index, if current and usable
+    long ix_len;
+    const unsigned long *block_off;
+    unsigned long nblocks;
+    unsigned char *want;    //per block: holds every trigram of the literal
+} file_t;
+
+typedef struct {
+    const char *path;
+    file_t *file;         //0 for a streamed job
+    long start, end;      //bytes whose lines belong to the job; end<0: stream
+    out_t out;
+    int done, failed;
+} job_t;
+
+static job_t *jobs;
+static int njobs, jobs_cap, window;
+static int next_job, written;
+static pthread_mutex_t job_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_finished=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_written=PTHREAD_COND_INITIALIZER;
+
+static void add_job(const char *path, file_t *file, const char *prefix, long start, long end){
+    if(njobs==jobs_cap){
+        jobs_cap=jobs_cap ? jobs_cap*2 : 64;
+        jobs=xrealloc(jobs, jobs_cap*sizeof(job_t));
+    }
+    memset(&jobs[njobs], 0, sizeof(job_t));
+    jobs[njobs].path=path;
+    jobs[njobs].file=file;
+    jobs[njobs].start=start;
+    jobs[njobs].end=end;
+    jobs[njobs].out.prefix=prefix;
+    jobs[njobs].out.prefix_len=prefix ? strlen(prefix) : 0;
+    jobs[njobs].out.copy=end<0;
+    njobs++;
+}
+
+static void report(const char *path, const char *msg){
+    write_all(2, "grep: ", 6);
+    write_all(2, path, strlen(path));
+    write_all(2, msg, strlen(msg));
+}
+
+//Queue jobs for a file, or for every file below a directory. Like grep -r,
+//symlinks are followed when named on the command line (top) but skipped
+//when met while recursing, so a link back up the tree cannot loop.
+static int add_input(const char *path, int with_names, int top){
+    struct stat st;
+    const char *prefix=0;
+
+    if((top ? stat(path, &st) : lstat(path, &st))<0){
+        report(path, ": cannot open\n");
+        return -1;
+    }
+    if(S_ISLNK(st.st_mode)) return 0;
+    if(S_ISDIR(st.st_mode)){
+        DIR *d=opendir(path);
+        struct dirent *e;
+        int ret=0;
+
+        if(!d){
+            report(path, ": cannot open\n");
+            return -1;
+        }
+        while((e=readdir(d))){
+            if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            long plen=strlen(path), nlen=strlen(e->d_name);
+            char *child=xrealloc(0, plen+nlen+2);
+            memcpy(child, path, plen);
+            child[plen]='/';
+            memcpy(child+plen+1, e->d_name, nlen+1);
+            ret|=add_input(child, with_names, 0);
+        }
+        closedir(d);
+        return ret;
+    }
+
+    if(with_names){
+        long plen=strlen(path);
+        char *p=xrealloc(0, plen+2);
+        memcpy(p, path, plen);
+        p[plen]=':';
+        p[plen+1]=0;
+        prefix=p;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size==0){
+        add_job(path, 0, prefix, 0, -1);
+        return 0;
+    }
+    file_t *f=xrealloc(0, sizeof(file_t));
+    memset(f, 0, sizeof(file_t));
+    f->path=path;
+    pthread_mutex_init(&f->lock, 0);
+    for(long off=0; off<st.st_size; off+=CHUNK_SIZE, f->jobs_left++)
+        add_job(path, f, prefix, off, off+CHUNK_SIZE<st.st_size ? off+CHUNK_SIZE : st.st_size);
+    return 0;
+}
+
+//Offset of the first line that starts at or after pos
+static long line_start(const char *map, long size, long pos){
+    const char *nl;
+
+    if(pos<=0) return 0;
+    if(pos>=size) return size;
+    nl=memchr(map+pos-1, '\n', size-pos+1);
+    return nl ? nl-map+1 : size;
+}
+
+//The index comes from disk and may be stale, truncated or corrupt, so
+//every size, offset and order it states is checked against the mapping
+//before any of it is used. Returns -1 if it is not usable for f.
+static int check_index(file_t *f, const char *ix, unsigned long len){
+    const struct tri_header *h=(const void *)ix;
+    const unsigned long *block_off=(const void *)(h+1);
+    const struct tri_entry *ent=(const void *)(block_off+h->nblocks+1);
+    unsigned long left=len-sizeof(*h);
+
+    if(h->magic!=TRI_MAGIC || h->file_size!=(unsigned long)f->st.st_size ||
+       h->mtime_sec!=f->st.st_mtim.tv_sec || h->mtime_nsec!=f->st.st_mtim.tv_nsec)
+        return -1;
+    if(h->nblocks==0 || left/sizeof(unsigned long)<h->nblocks+1UL) return -1;
+    left-=(h->nblocks+1UL)*sizeof(unsigned long);
+    if(left/sizeof(struct tri_entry)<h->ntri) return -1;
+    left-=h->ntri*sizeof(struct tri_entry);     //what is left holds the lists
+
+    if(block_off[0]!=0 || block_off[h->nblocks]!=h->file_size) return -1;
+    for(unsigned long b=0; b<h->nblocks; b++)
+        if(block_off[b]>block_off[b+1]) return -1;
+    for(unsigned long i=0; i<h->ntri; i++){
+        if(i>0 && ent[i].tri<=ent[i-1].tri) return -1;
+        if(ent[i].off>=left || ent[i].count>h->nblocks) return -1;
+    }
+    return 0;
+}
+
+//Intersects the posting lists of the literal's trigrams into f->want.
+//Returns -1 if a list runs past the end of the index or names a block
+//that does not exist; f->want is then left unset.
+static int intersect_index(file_t *f, const char *ix, unsigned long len, const char *lit, long m){
+    const struct tri_header *h=(const void *)ix;
+    const unsigned long *block_off=(const void *)(h+1);
+    const struct tri_entry *ent=(const void *)(block_off+h->nblocks+1);
+    const unsigned char *lists=(const void *)(ent+h->ntri);
+    const unsigned char *end=(const unsigned char *)ix+len;
+    unsigned short *hits=xrealloc(0, h->nblocks*sizeof(unsigned short));
+    int need=0, bad=0;
+
+    //a per-block count of the trigrams seen so far
+    memset(hits, 0, h->nblocks*sizeof(unsigned short));
+    for(long i=0; i+3<=m && !bad; i++){
+        unsigned int t=tri_of(lit+i);
+        unsigned long lo=0, hi=h->ntri;
+        int dup=0;
+        for(long k=0; k<i && !dup; k++) dup=tri_of(lit+k)==t;
+        if(dup) continue;
+        while(lo<hi){
+            unsigned long mid=(lo+hi)/2;
+            if(ent[mid].tri<t) lo=mid+1;
+            else hi=mid;
+        }
+        need++;
+        if(lo==h->ntri || ent[lo].tri!=t) break;      //no block can match
+        const unsigned char *p=lists+ent[lo].off;
+        unsigned long b=0, d;
+        for(unsigned int k=0; k<ent[lo].count; k++){
+            if(!(p=tri_get_varint(p, end, &d)) || d>=h->nblocks-b){
+                bad=1;
+                break;
             }
+            b+=d;
+            if(hits[b]==need-1) hits[b]=need;
         }
     }
+    if(!bad){
+        f->want=xrealloc(0, h->nblocks);
+        for(unsigned long b=0; b<h->nblocks; b++) f->want[b]=hits[b]==need;
+    }
+    free(hits);
+    return bad ? -1 : 0;
+}
+
+/*
+ * If grepindex has written a current "path.tri", only the blocks holding
+ * every trigram of the literal (the word, or the regex's required literal)
+ * can contain a match. The posting lists are intersected once per file,
+ * when it is mapped, into f->want; each job then scans just the wanted
+ * blocks of its range and the rest of the file is never read. Without a
+ * usable index f->want stays 0 and the jobs scan everything.
+ */
+static void load_index(file_t *f){
+    const char *lit=nfa ? re_lit : word;
+    long m=nfa ? re_lit_len : word_len;
+    struct stat ist;
+    char path[4096];
+    long plen=strlen(f->path);
+    int fd;
+
+    if(ac || m<3 || plen+5>(long)sizeof(path)) return;
+    memcpy(path, f->path, plen);
+    memcpy(path+plen, ".tri", 5);
+    if((fd=open(path, O_RDONLY))<0) return;
+    if(fstat(fd, &ist)<0 || ist.st_size<(long)sizeof(struct tri_header)){
+        close(fd);
+        return;
+    }
+    char *ix=mmap(0, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
+    if(ix==MAP_FAILED) return;
+
+    if(check_index(f, ix, ist.st_size) || intersect_index(f, ix, ist.st_size, lit, m)){
+        munmap(ix, ist.st_size);
+        return;
+    }
+    const struct tri_header *h=(const void *)ix;
+    f->ix=ix;
+    f->ix_len=ist.st_size;
+    f->block_off=(const void *)(h+1);
+    f->nblocks=h->nblocks;
+}
+
+//Scans the wanted blocks overlapping [from, to); -1 if there is no index
+static int scan_indexed(job_t *j, long from, long to){
+    file_t *f=j->file;
+    unsigned long lo=0, hi=f->nblocks;
+
+    if(!f->want) return -1;
+    //first block ending after from
+    while(lo<hi){
+        unsigned long mid=(lo+hi)/2;
+        if(f->block_off[mid+1]<=(unsigned long)from) lo=mid+1;
+        else hi=mid;
+    }
+    for(unsigned long b=lo; b<f->nblocks && f->block_off[b]<(unsigned long)to; b++){
+        long s=f->block_off[b]>(unsigned long)from ? (long)f->block_off[b] : from;
+        long e=f->block_off[b+1]<(unsigned long)to ? (long)f->block_off[b+1] : to;
+        if(f->want[b] && s<e) scan_lines(&j->out, f->map+s, e-s);
+    }
     return 0;
 }
+
+//Maps f on the first call; later calls wait for that one to finish. The
+//file may have changed size since the jobs were planned, the mapping
+//covers what is there now.
+static void map_file(file_t *f){
+    pthread_mutex_lock(&f->lock);
+    if(!f->mapped){
+        int fd=open(f->path, O_RDONLY);
+        f->mapped=1;
+        if(fd<0 || fstat(fd, &f->st)<0) f->failed=1;
+        else if(f->st.st_size>0){
+            f->map=mmap(0, f->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(f->map==MAP_FAILED){
+                f->map=0;
+                f->failed=1;
+            } else {
+                f->map_len=f->st.st_size;
+                load_index(f);
+                //huge pages are only a hint (file THP needs kernel support)
+#ifdef MADV_HUGEPAGE
+                madvise(f->map, f->map_len, MADV_HUGEPAGE);
+#endif
+            }
+        }
+        if(fd>=0) close(fd);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void free_file(file_t *f){
+    if(f->map) munmap(f->map, f->map_len);
+    if(f->ix) munmap(f->ix, f->ix_len);
+    free(f->want);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+static void run_job(job_t *j){
+    file_t *f=j->file;
+
+    if(!f){
+        int fd=open(j->path, O_RDONLY);
+        if(fd<0){
+            j->failed=1;
+            return;
+        }
+        j->failed=grep_stream(&j->out, fd)<0;
+        close(fd);
+        return;
+    }
+
+    map_file(f);
+    if(f->failed){
+        j->failed=1;
+        return;
+    }
+    //the file may have shrunk since the jobs were planned
+    if(f->map_len<=j->start) return;
+
+    long from=line_start(f->map, f->map_len, j->start);
+    long to=line_start(f->map, f->map_len, j->end);
+    if(scan_indexed(j, from, to)==0) return;
+
+    //read-ahead aggressively over our part
+    long page=from & ~4095L;
+    madvise(f->map+page, to-page, MADV_SEQUENTIAL);
+    scan_lines(&j->out, f->map+from, to-from);
+}
+
+static void *worker(void *arg){
+    for(;;){
+        pthread_mutex_lock(&job_lock);
+        while(next_job<njobs && next_job>=written+window)
+            pthread_cond_wait(&job_written, &job_lock);
+        if(next_job>=njobs){
+            pthread_mutex_unlock(&job_lock);
+            return arg;
+        }
+        job_t *j=&jobs[next_job++];
+        pthread_mutex_unlock(&job_lock);
+
+        run_job(j);
+
+        pthread_mutex_lock(&job_lock);
+        j->done=1;
+        pthread_cond_signal(&job_finished);
+        pthread_mutex_unlock(&job_lock);
+    }
+}
+
+int main(int argc, char *argv[]){
+    struct stat st;
+    int ret=0, nworkers, started, err=0;
+    pthread_t *workers;
+
+    //"-f file" (or "-f -" for stdin) gives a list of patterns, one per
+    //line; otherwise the search word (or regex) is read from stdin
+    if(argc>2 && !strcmp(argv[1], "-f")){
+        char **pat;
+        long *pat_len;
+        int fd=strcmp(argv[2], "-") ? open(argv[2], O_RDONLY) : 0;
+        if(fd<0) return 1;
+        int npat=read_patterns(fd, &pat, &pat_len);
+        if(fd) close(fd);
+        ac=ac_build(pat, pat_len, npat);
+        argv+=2;
+        argc-=2;
+    } else {
+        //"-E": the line read from stdin is a regular expression
+        int regex=argc>1 && !strcmp(argv[1], "-E");
+        if(regex) argv++, argc--;
+        while (word_len<WORD_SIZE-1 && read(0, word+word_len, 1)>0 && word[word_len]!='\n') word_len++;
+        word[word_len]=0;
+        if(regex){
+            if(re_compile(word)<0){
+                report(word, ": bad regular expression\n");
+                return 2;
+            }
+            search=pick_search(re_lit, re_lit_len);
+        } else search=pick_search(word, word_len);
+    }
+
+    if(argc<2) return 1;
+
+    //A single pipe or device is streamed as it arrives, not buffered as a job
+    if(argc==2 && stat(argv[1], &st)==0 && !S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)){
+        out_t o={0};
+        int fd=open(argv[1], O_RDONLY);
+        if(fd<0) return 1;
+        ret=grep_stream(&o, fd);
+        free_out(&o);
+        close(fd);
+        return ret<0;
+    }
+
+    //Plan the jobs, file names are printed as grep does for several files
+    for(int i=1; i<argc; i++)
+        ret|=add_input(argv[i], argc>2 || (stat(argv[i], &st)==0 && S_ISDIR(st.st_mode)), 1);
+
+    nworkers=sysconf(_SC_NPROCESSORS_ONLN);
+    if(nworkers>njobs) nworkers=njobs;
+    if(nworkers<1) nworkers=1;
+    window=nworkers*WINDOW_PER_WORKER;
+    workers=xrealloc(0, nworkers*sizeof(pthread_t));
+    for(started=0; started<nworkers; started++)
+        if((err=pthread_create(&workers[started], 0, worker, 0))) break;
+    if(err) report("pthread_create", started ? ": running with fewer workers\n" : ": searching without workers\n");
+
+    //Write the jobs out in order as they finish; with no workers the jobs
+    //are run here, one at a time, just before they are written
+    for(int i=0; i<njobs; i++){
+        job_t *j=&jobs[i];
+
+        if(!started){
+            run_job(j);
+            j->done=1;
+        }
+        pthread_mutex_lock(&job_lock);
+        while(!j->done) pthread_cond_wait(&job_finished, &job_lock);
+        pthread_mutex_unlock(&job_lock);
+
+        if(j->failed){
+            report(j->path, ": read error\n");
+            ret=-1;
+        }
+        flush_out(&j->out);
+        free_out(&j->out);
+        if(j->file && --j->file->jobs_left==0) free_file(j->file);
+
+        pthread_mutex_lock(&job_lock);
+        written++;
+        pthread_cond_broadcast(&job_written);
+        pthread_mutex_unlock(&job_lock);
+    }
+
+    for(int i=0; i<started; i++)
+        pthread_join(workers[i], 0);
+    free(workers);
+    return ret!=0;
+}
@@ -0,0 +1,391 @@
+/*
+Benchmark driver for grep.c. It includes grep.c itself (with its main
+renamed), so the search routines can be timed directly and whole searches
+can be run in a forked child without a separate binary.
+
+    gcc -O2 -pthread -o grepbench grepbench.c
+
+    grepbench gen FILE MIB        write MIB MiB of synthetic access log lines
+    grepbench search FILE WORD    GB/s of each substring search routine
+    grepbench io FILE WORD        the file through mmap vs through a pipe
+    grepbench multi FILE          -f with 1 to 10000 request IDs from FILE
+    grepbench regex FILE [RE...]  -E with RE, or a fixed set of log regexes
+    grepbench index FILE [GREPINDEX]
+                                  build FILE.tri, then search with and
+                                  without it (GREPINDEX: ./grepindex)
+
+Whole searches run grep_main in a forked child with the word on its stdin
+and its output going to a scratch file (GNU grep stops at the first match
+when it sees /dev/null). The GNU grep columns exec "grep" the same way,
+and show "-" if it is not installed. Times are the best of REPS runs on a
+warm page cache unless marked cold: those drop the file from the cache
+with POSIX_FADV_DONTNEED first, which a VM's host cache may still hide.
+*/
+
+#define _GNU_SOURCE     //memmem
+#include<stdio.h>
+#include<time.h>
+#include<sys/wait.h>
+
+#define main grep_main
+#include"grep.c"
+#undef main
+
+#define REPS 5
+#define SCRATCH "/tmp/grepbench.out"
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static unsigned long rng_state=0x9e3779b97f4a7c15UL;
+
+static unsigned long rng(void){
+    rng_state^=rng_state<<13;
+    rng_state^=rng_state>>7;
+    rng_state^=rng_state<<17;
+    return rng_state;
+}
+
+//Lines look like
+//  2026-10-17 12:00:00 INFO req=247a8d323d9e user=994 GET /api/v1 status=404 latency=299ms
+//with the clock advancing one second every 25 lines
+static int gen(const char *path, long mib){
+    static const char *level[]={"INFO", "INFO", "INFO", "INFO", "WARN", "ERROR"};
+    static const char *method[]={"GET", "GET", "POST", "PUT"};
+    static const int status[]={200, 200, 200, 404, 500};
+    FILE *f=fopen(path, "w");
+    long size=0, line=0;
+
+    if(!f){
+        perror(path);
+        return 1;
+    }
+    while(size<mib*1024*1024){
+        long t=12*3600+line++/25;
+        int n=fprintf(f, "2026-10-17 %02ld:%02ld:%02ld %s req=%012lx user=%lu %s /api/v%lu status=%d latency=%lums\n",
+                      t/3600%24, t/60%60, t%60, level[rng()%6], rng()&0xffffffffffffUL, rng()%999+1,
+                      method[rng()%4], rng()%2+1, status[rng()%5], rng()%299+1);
+        if(n<0) break;
+        size+=n;
+    }
+    if(fclose(f)!=0){
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+static const char *map_whole(const char *path, long *size){
+    struct stat st;
+    int fd=open(path, O_RDONLY);
+    char *p;
+
+    if(fd<0 || fstat(fd, &st)<0 || st.st_size==0){
+        perror(path);
+        exit(1);
+    }
+    p=mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p==MAP_FAILED){
+        perror(path);
+        exit(1);
+    }
+    *size=st.st_size;
+    return p;
+}
+
+//Counts the matches of w in s with fn, restarting one byte past each one
+static long count_matches(search_fn fn, const char *s, long n, const char *w, long m){
+    const char *end=s+n, *p;
+    long count=0;
+
+    for(p=s; (p=fn(p, end-p, w, m)); p++) count++;
+    return count;
+}
+
+static void time_routine(const char *name, search_fn fn, const char *s, long n, const char *w, long m){
+    double best=1e9;
+    long count=0;
+
+    for(int r=0; r<REPS; r++){
+        double t=now();
+        count=count_matches(fn, s, n, w, m);
+        t=now()-t;
+        if(t<best) best=t;
+    }
+    printf("  %-9s %6.2f GB/s  %ld matches\n", name, n/best/1e9, count);
+}
+
+static int bench_search(const char *path, const char *w){
+    long n, m=strlen(w);
+    const char *s=map_whole(path, &n);
+
+    if(m==0) return 1;
+    for(int r=0; r<REPS; r++) count_matches(search_byte, s, n, "\n", 1);     //fault the mapping in
+    printf("%ld-byte pattern over %.0f MiB\n", m, n/1048576.0);
+    if(m==1) time_routine("memchr", search_byte, s, n, w, m);
+    time_routine("scalar", search_scalar, s, n, w, m);
+    if(m>=2){
+        horspool_init(w, m);
+        time_routine("horspool", search_horspool, s, n, w, m);
+    }
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if(m>=2 && __builtin_cpu_supports("sse2")) time_routine("sse2", search_sse2, s, n, w, m);
+    if(m>=2 && __builtin_cpu_supports("avx2")) time_routine("avx2", search_avx2, s, n, w, m);
+#endif
+    return 0;
+}
+
+static void drop_cache(const char *path){
+    int fd=open(path, O_RDONLY);
+    if(fd<0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+//Copies path into fd and exits; the feeder for a search through a pipe
+static void feed(const char *path, int fd){
+    long n;
+    const char *s=map_whole(path, &n);
+    write_all(fd, s, n);
+    _exit(0);
+}
+
+//Runs grep_main(argv), or the program argv[0] if external is set, once in
+//a child and returns the wall time, or -1 if the program could not be run. The input
+//goes to its stdin; if pipe_from is set, that file is fed through a pipe
+//on fd 3 so argv can name "/dev/fd/3".
+static double run_once(char **argv, const char *input, const char *pipe_from, int external){
+    int in[2], data[2]={-1, -1}, status;
+    pid_t pid, feeder=0;
+    double t;
+
+    if(pipe(in)<0 || (pipe_from && pipe(data)<0)){
+        perror("pipe");
+        exit(1);
+    }
+    t=now();
+    if(pipe_from && (feeder=fork())==0){
+        close(in[0]);
+        close(in[1]);
+        close(data[0]);
+        feed(pipe_from, data[1]);
+    }
+    if((pid=fork())==0){
+        int out=open(SCRATCH, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        dup2(in[0], 0);
+        dup2(out, 1);
+        if(pipe_from) dup2(data[0], 3);
+        close(in[1]);
+        if(pipe_from) close(data[1]);
+        if(external){
+            execvp(argv[0], argv);
+            _exit(127);
+        }
+        int argc=0;
+        while(argv[argc]) argc++;
+        _exit(grep_main(argc, argv));
+    }
+    close(in[0]);
+    if(pipe_from){
+        close(data[0]);
+        close(data[1]);
+    }
+    write_all(in[1], input, strlen(input));
+    close(in[1]);
+    waitpid(pid, &status, 0);
+    if(feeder) waitpid(feeder, 0, 0);
+    t=now()-t;
+    if(external && WIFEXITED(status) && WEXITSTATUS(status)==127) return -1;
+    if(!WIFEXITED(status) || WEXITSTATUS(status)>1){
+        fprintf(stderr, "%s: search failed\n", argv[0]);
+        exit(1);
+    }
+    return t;
+}
+
+static double run_best(char **argv, const char *input, const char *pipe_from, const char *cold, int external){
+    double best=1e9;
+
+    for(int r=0; r<REPS; r++){
+        if(cold) drop_cache(cold);
+        double t=run_once(argv, input, pipe_from, external);
+        if(t<0) return t;
+        if(t<best) best=t;
+    }
+    return best;
+}
+
+//The mapped path against the streaming read() path, which grep takes for
+//any input that is not a regular file
+static int bench_io(const char *path, const char *w){
+    char word[WORD_SIZE+1], *file_argv[]={"grep", (char *)path, 0}, *pipe_argv[]={"grep", "/dev/fd/3", 0};
+
+    if(strlen(w)>=WORD_SIZE) return 1;
+    strcpy(word, w);
+    strcat(word, "\n");
+    run_once(file_argv, word, 0, 0);
+    printf("%-10s %8s %8s\n", "", "read()", "mmap");
+    printf("%-10s %7.3fs %7.3fs\n", "cold", run_best(pipe_argv, word, path, path, 0), run_best(file_argv, word, 0, path, 0));
+    printf("%-10s %7.3fs %7.3fs\n", "warm", run_best(pipe_argv, word, path, 0, 0), run_best(file_argv, word, 0, 0, 0));
+    return 0;
+}
+
+static void print_time(double t){
+    if(t<0) printf(" %7s", "-");
+    else printf(" %6.2fs", t);
+}
+
+//The distinct "req=" IDs of the file, in a fixed pseudo-random order
+static int request_ids(const char *s, long n, char ids[][13], int max){
+    const char *end=s+n, *p=s;
+    int count=0;
+
+    while(count<max && (p=memmem(p, end-p, "req=", 4)) && end-p>=16){
+        int dup=0;
+        for(int i=0; i<count && !dup; i++) dup=!memcmp(ids[i], p+4, 12);
+        if(!dup){
+            memcpy(ids[count], p+4, 12);
+            ids[count++][12]=0;
+        }
+        p+=16;
+    }
+    for(int i=count-1; i>0; i--){
+        char t[13];
+        int k=rng()%(i+1);
+        memcpy(t, ids[i], 13);
+        memcpy(ids[i], ids[k], 13);
+        memcpy(ids[k], t, 13);
+    }
+    return count;
+}
+
+//"-f" with growing sets of request IDs drawn from the file, against GNU
+//grep -F -f and against one single-word search (which a caller without
+//-f would repeat once per ID)
+static int bench_multi(const char *path){
+    static char ids[10000][13];
+    static const int sizes[]={1, 10, 100, 1000, 10000};
+    char pats[]="/tmp/grepbench.XXXXXX", word[14];
+    char *argv[]={"grep", "-f", pats, (char *)path, 0}, *gnu_argv[]={"grep", "-F", "-f", pats, (char *)path, 0};
+    char *word_argv[]={"grep", (char *)path, 0};
+    long n;
+    const char *s=map_whole(path, &n);
+    int count=request_ids(s, n, ids, 10000), fd;
+
+    if(count==0 || (fd=mkstemp(pats))<0){
+        fprintf(stderr, "%s: no request IDs\n", path);
+        return 1;
+    }
+    close(fd);
+    memcpy(word, ids[0], 12);
+    strcpy(word+12, "\n");
+    run_once(word_argv, word, 0, 0);
+    printf("one word: %.3fs\n%-10s %8s %8s\n", run_best(word_argv, word, 0, 0, 0), "patterns", "-f", "GNU -F");
+    for(int i=0; i<5 && sizes[i]<=count; i++){
+        FILE *f=fopen(pats, "w");
+        for(int k=0; k<sizes[i]; k++) fprintf(f, "%s\n", ids[k]);
+        fclose(f);
+        printf("%-10d", sizes[i]);
+        print_time(run_best(argv, "", 0, 0, 0));
+        print_time(run_best(gnu_argv, "", 0, 0, 1));
+        printf("\n");
+    }
+    unlink(pats);
+    return 0;
+}
+
+//"-E" against GNU grep -E, for the given regexes or a default set: one with
+//a long required literal, one whose literal is too short to filter on, and
+//an anchored one
+static int bench_regex(const char *path, char **re, int nre){
+    static char *fixed[]={"status=200 latency=29[0-9]ms$", "req=[0-9a-f]*dead", "^2026-10-17 12:0[0-5]:[0-9]+ INFO"};
+    char *argv[]={"grep", "-E", (char *)path, 0}, *gnu_argv[]={"grep", "-E", 0, (char *)path, 0};
+    char line[WORD_SIZE+1];
+
+    if(nre==0){
+        re=fixed;
+        nre=3;
+    }
+    printf("%-36s %8s %8s\n", "regex", "-E", "GNU -E");
+    for(int i=0; i<nre; i++){
+        if(strlen(re[i])>=WORD_SIZE) return 1;
+        strcpy(line, re[i]);
+        strcat(line, "\n");
+        gnu_argv[2]=re[i];
+        run_once(argv, line, 0, 0);
+        printf("%-36s", re[i]);
+        print_time(run_best(argv, line, 0, 0, 0));
+        print_time(run_best(gnu_argv, "", 0, 0, 1));
+        printf("\n");
+    }
+    return 0;
+}
+
+//Builds the trigram index with grepindex, then times searches for a rare
+//request ID, an absent word and a word found in most blocks, with the
+//index and with it moved aside
+static int bench_index(const char *path, const char *grepindex){
+    static char ids[100][13];
+    char *build_argv[]={(char *)grepindex, (char *)path, 0}, *argv[]={"grep", (char *)path, 0};
+    char tri[4096], aside[4096], word[3][16];
+    struct stat st, ist;
+    long n;
+    const char *s=map_whole(path, &n);
+    double with[3];
+
+    if(strlen(path)+12>sizeof(tri) || request_ids(s, n, ids, 100)==0){
+        fprintf(stderr, "%s: no request IDs\n", path);
+        return 1;
+    }
+    strcpy(tri, path);
+    strcat(tri, ".tri");
+    strcpy(aside, tri);
+    strcat(aside, ".aside");
+    sprintf(word[0], "%s\n", ids[0]);
+    strcpy(word[1], "deadbeef\n");
+    strcpy(word[2], "user=97 \n");
+
+    double t=run_best(build_argv, "", 0, 0, 1);
+    if(t<0 || stat(path, &st)<0 || stat(tri, &ist)<0){
+        fprintf(stderr, "%s: cannot run\n", grepindex);
+        return 1;
+    }
+    printf("build: %.2fs, index %.1f MiB (%.1f%% of the file)\n", t, ist.st_size/1048576.0, 100.0*ist.st_size/st.st_size);
+    for(int i=0; i<3; i++){
+        run_once(argv, word[i], 0, 0);
+        with[i]=run_best(argv, word[i], 0, 0, 0);
+    }
+    if(rename(tri, aside)<0){
+        perror(tri);
+        return 1;
+    }
+    printf("%-12s %9s %9s\n", "word", "full scan", "indexed");
+    for(int i=0; i<3; i++){
+        printf("%-12.*s %8.0fms %8.0fms\n", (int)strlen(word[i])-1, word[i],
+               run_best(argv, word[i], 0, 0, 0)*1000, with[i]*1000);
+    }
+    rename(aside, tri);
+    return 0;
+}
+
+static void remove_scratch(void){
+    unlink(SCRATCH);
+}
+
+int main(int argc, char *argv[]){
+    atexit(remove_scratch);
+    if(argc==4 && !strcmp(argv[1], "gen")) return gen(argv[2], atol(argv[3]));
+    if(argc==4 && !strcmp(argv[1], "search")) return bench_search(argv[2], argv[3]);
+    if(argc==4 && !strcmp(argv[1], "io")) return bench_io(argv[2], argv[3]);
+    if(argc==3 && !strcmp(argv[1], "multi")) return bench_multi(argv[2]);
+    if(argc>=3 && !strcmp(argv[1], "regex")) return bench_regex(argv[2], argv+3, argc-3);
+    if((argc==3 || argc==4) && !strcmp(argv[1], "index")) return bench_index(argv[2], argc==4 ? argv[3] : "./grepindex");
+    fprintf(stderr, "usage: %s gen FILE MIB | search FILE WORD | io FILE WORD | multi FILE | regex FILE [RE...] | index FILE [GREPINDEX]\n", argv[0]);
+    return 1;
+}
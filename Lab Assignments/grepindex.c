@@ -0,0 +1,224 @@
+/*
+Companion indexer for grep.c: for each file given, write "file.tri", a
+trigram index of the file (format in trigram.h). grep.c picks the index up
+by itself when it is current and only reads the blocks that can contain
+the word.
+
+The file is cut into line-aligned blocks of about TRI_BLOCK bytes. Every
+trigram seen in a block adds the block number to that trigram's posting
+list, stored as varint deltas. A 2^24-bit bitmap makes sure each trigram
+is counted once per block, so the hash table is only touched on the first
+occurrence in a block.
+*/
+
+#include<unistd.h>
+#include<fcntl.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdio.h>    //rename
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include"trigram.h"
+
+typedef struct {
+    unsigned int tri;            //EMPTY when the slot is free
+    unsigned int count;
+    unsigned int last;           //last block added, plus one
+    unsigned int len, cap;
+    unsigned char *buf;
+} posting_t;
+
+#define EMPTY 0xffffffffu
+
+static posting_t *table;
+static unsigned long table_cap, table_used;
+static unsigned char seen[(1<<24)/8];
+
+static void *xrealloc(void *p, long n){
+    if(!(p=realloc(p, n))) exit(2);
+    return p;
+}
+
+static int write_all(int fd, const void *s, long n){
+    long w;
+    while(n>0 && (w=write(fd, s, n))>0) s=(const char *)s+w, n-=w;
+    return n==0 ? 0 : -1;
+}
+
+static void report(const char *path, const char *msg){
+    if(write_all(2, "grepindex: ", 11)<0 || write_all(2, path, strlen(path))<0) return;
+    write_all(2, msg, strlen(msg));
+}
+
+static posting_t *lookup(unsigned int tri){
+    unsigned long i=(tri*2654435761u)&(table_cap-1);
+    while(table[i].tri!=EMPTY && table[i].tri!=tri) i=(i+1)&(table_cap-1);
+    return &table[i];
+}
+
+static void grow(){
+    posting_t *old=table;
+    unsigned long old_cap=table_cap;
+
+    table_cap=table_cap ? table_cap*2 : 1<<16;
+    table=xrealloc(0, table_cap*sizeof(posting_t));
+    for(unsigned long i=0; i<table_cap; i++) table[i].tri=EMPTY;
+    for(unsigned long i=0; i<old_cap; i++)
+        if(old[i].tri!=EMPTY) *lookup(old[i].tri)=old[i];
+    free(old);
+}
+
+static void add(unsigned int tri, unsigned int block){
+    posting_t *p=lookup(tri);
+
+    if(p->tri==EMPTY){
+        if(2*(table_used+1)>table_cap){
+            grow();
+            p=lookup(tri);
+        }
+        memset(p, 0, sizeof(posting_t));
+        p->tri=tri;
+        table_used++;
+    }
+    if(p->len+10>p->cap){
+        p->cap=p->cap ? p->cap*2 : 16;
+        p->buf=xrealloc(p->buf, p->cap);
+    }
+    p->len=tri_put_varint(p->buf+p->len, block-(p->last ? p->last-1 : 0))-p->buf;
+    p->last=block+1;
+    p->count++;
+}
+
+static int cmp_tri(const void *a, const void *b){
+    unsigned int x=((const posting_t *)a)->tri, y=((const posting_t *)b)->tri;
+    return x<y ? -1 : x>y;
+}
+
+static int build(const char *path){
+    struct stat st;
+    struct tri_header h;
+    unsigned long *block_off=0, nblocks=0, touched_len=0, off, list_off;
+    unsigned int *touched;
+    char *map, tmp[4096], dst[4096];
+    long plen=strlen(path);
+    int fd, ret=0;
+
+    //room for the ".tri.tmp" suffix; longer paths are skipped, not cut
+    if(plen+9>(long)sizeof(tmp)){
+        report(path, ": path too long\n");
+        return -1;
+    }
+    memcpy(tmp, path, plen);
+    memcpy(tmp+plen, ".tri.tmp", 9);
+    memcpy(dst, path, plen);
+    memcpy(dst+plen, ".tri", 5);
+    if((fd=open(path, O_RDONLY))<0){
+        report(path, ": cannot open\n");
+        return -1;
+    }
+    if(fstat(fd, &st)<0 || !S_ISREG(st.st_mode)){
+        report(path, ": cannot open\n");
+        close(fd);
+        return -1;
+    }
+    map=st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+    close(fd);
+    if(map==MAP_FAILED){
+        report(path, ": cannot map\n");
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    touched=xrealloc(0, TRI_BLOCK*sizeof(unsigned int));
+
+    table_used=0;
+    grow();
+    for(off=0; off<(unsigned long)st.st_size; nblocks++){
+        unsigned long end=off+TRI_BLOCK;
+        if(end>=(unsigned long)st.st_size) end=st.st_size;
+        else {
+            char *nl=memchr(map+end-1, '\n', st.st_size-end+1);
+            end=nl ? (unsigned long)(nl-map+1) : (unsigned long)st.st_size;
+        }
+        block_off=xrealloc(block_off, (nblocks+2)*sizeof(unsigned long));
+        block_off[nblocks]=off;
+
+        //trigrams across a line end can never be part of a match
+        touched_len=0;
+        for(unsigned long i=off; i+2<end; i++){
+            if(map[i+2]=='\n'){
+                i+=2;
+                continue;
+            }
+            if(map[i+1]=='\n'){
+                i++;
+                continue;
+            }
+            if(map[i]=='\n') continue;
+            unsigned int t=tri_of(map+i);
+            if(seen[t>>3]&(1<<(t&7))) continue;
+            seen[t>>3]|=1<<(t&7);
+            if(touched_len%TRI_BLOCK==0 && touched_len)
+                touched=xrealloc(touched, (touched_len+TRI_BLOCK)*sizeof(unsigned int));
+            touched[touched_len++]=t;
+            add(t, nblocks);
+        }
+        for(unsigned long k=0; k<touched_len; k++) seen[touched[k]>>3]=0;
+        off=end;
+    }
+    block_off=xrealloc(block_off, (nblocks+1)*sizeof(unsigned long));
+    block_off[nblocks]=st.st_size;
+
+    //compact the table into sorted entries
+    unsigned long n=0;
+    for(unsigned long i=0; i<table_cap; i++)
+        if(table[i].tri!=EMPTY) table[n++]=table[i];
+    qsort(table, n, sizeof(posting_t), cmp_tri);
+
+    h.magic=TRI_MAGIC;
+    h.nblocks=nblocks;
+    h.ntri=n;
+    h.file_size=st.st_size;
+    h.mtime_sec=st.st_mtim.tv_sec;
+    h.mtime_nsec=st.st_mtim.tv_nsec;
+
+    //write to a temporary name so readers never see half an index
+    if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644))<0){
+        report(tmp, ": cannot create\n");
+        ret=-1;
+    } else {
+        ret|=write_all(fd, &h, sizeof(h));
+        ret|=write_all(fd, block_off, (nblocks+1)*sizeof(unsigned long));
+        list_off=0;
+        for(unsigned long i=0; i<n && !ret; i++){
+            struct tri_entry e={table[i].tri, table[i].count, list_off};
+            ret|=write_all(fd, &e, sizeof(e));
+            list_off+=table[i].len;
+        }
+        for(unsigned long i=0; i<n && !ret; i++)
+            ret|=write_all(fd, table[i].buf, table[i].len);
+        if(close(fd)<0) ret=-1;
+    }
+
+    for(unsigned long i=0; i<n; i++) free(table[i].buf);
+    free(table);
+    table=0;
+    table_cap=0;
+    free(block_off);
+    free(touched);
+    if(map) munmap(map, st.st_size);
+    if(fd<0) return -1;
+
+    if(ret || rename(tmp, dst)<0){
+        report(tmp, ": write failed\n");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int ret=0;
+
+    for(int i=1; i<argc; i++) ret|=build(argv[i]);
+    return ret!=0;
+}
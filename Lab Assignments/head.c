@@ -13,32 +13,48 @@ Also submit Modified Makefile
 #include"user.h"
 #include"fcntl.h"
 
-int main(int argc, char *argv[]){
-    int fd, n, i;
-    char buf[256];
-    int line_count=0;
-    int lines_to_show=10;
+#define BUF_SIZE 4096
+
+// Static so the buffer does not eat into the one-page user stack
+static char buf[BUF_SIZE];
+
+// Copy the first `count` lines (or bytes, if bytes is set) of fd to stdout.
+// Each read is scanned for the cut-off point and everything before it goes
+// out in a single write, instead of one write per character.
+int head(int fd, int count, int bytes){
+    int n = 0, i;
+
+    while(count>0 && (n=read(fd, buf, sizeof(buf)))>0){
+        if(bytes){
+            i = n<count ? n : count;
+            count -= i;
+        } else {
+            for(i=0; i<n && count>0; i++)
+                if(buf[i]=='\n') count--;
+        }
+        if(write(1, buf, i)!=i) return -1;
+    }
+    return n<0 ? -1 : 0;
+}
 
-    if(argc<2){
-        exit();
+int main(int argc, char *argv[]){
+    int fd=0, i=1;
+    int count=10, bytes=0;
+
+    // head [-n lines | -c bytes] [file]
+    if(i+1<argc && (strcmp(argv[i], "-n")==0 || strcmp(argv[i], "-c")==0)){
+        bytes = argv[i][1]=='c';
+        count = atoi(argv[i+1]);
+        i += 2;
     }
 
-    if((fd=open(argv[1], O_RDONLY))<0){
+    if(i<argc && (fd=open(argv[i], O_RDONLY))<0){
+        printf(2, "head: cannot open %s\n", argv[i]);
         exit();
     }
 
-    while((n=read(fd, buf, sizeof(buf)))> 0 && line_count<lines_to_show){
-        for(i=0;i<n;i++) {
-            if(buf[i]=='\n') {
-                line_count++;
-                if(line_count>=lines_to_show){
-                    break;
-                }
-            }
-            printf(1, "%c", buf[i]);
-        }
-    }
-    close(fd);
+    if(head(fd, count, bytes)<0)
+        printf(2, "head: read error\n");
+    if(fd) close(fd);
     exit();
 }
-
@@ -1,82 +1,185 @@
-#define _LARGEFILE64_SOURCE
-
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
 #include <errno.h>
-#include <unistd.h>
-#include <sys/types.h> 
-#include <ext2fs/ext2_fs.h> 
-
-int main(int argc, char *argv[]) {
-    int fd, i;
-    int ino, bgno, index;
-    int inode_size, block_size;
-    unsigned long inode_offset;
-    ssize_t count;
-
-    struct ext2_super_block sb;
-    struct ext2_group_desc bgdesc;
-    struct ext2_inode inode;
-
-    if (argv[2][0] == '/')
-        ino = atoi(argv[2] + 1);
-    else
-        ino = atoi(argv[2]);
-
-    fd = open(argv[1], O_RDONLY);
-    if (fd == -1) {
-        perror("open");
-        exit(errno);
+#include <string.h>
+#include "ext2img.h"
+
+// State for -c: the bytes of the file not written yet
+typedef struct {
+    const ext2_t *fs;
+    unsigned long left;
+} extract_t;
+
+static int write_all(const char *p, unsigned long n) {
+    long w;
+
+    while (n > 0) {
+        if ((w = write(1, p, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
     }
+    return 0;
+}
 
-    // Read superblock
-    lseek64(fd, 1024, SEEK_SET);
-    count = read(fd, &sb, sizeof(sb));
+// One run of contiguous blocks goes out with a single write() straight from
+// the mapping of the image; holes are written from a block of zeros.
+static int write_run(void *arg, unsigned long blk, unsigned long count) {
+    static const char zeros[64 * 1024];
+    extract_t *x = arg;
+    unsigned long n = count * x->fs->block_size, k;
+
+    if (n > x->left)
+        n = x->left;
+    x->left -= n;
+    if (blk) {
+        const unsigned char *p = ext2_block(x->fs, blk);
+        if (!p || blk + count > x->fs->size / x->fs->block_size)
+            return -1;
+        madvise((void *)((unsigned long)p & ~4095UL), n + ((unsigned long)p & 4095), MADV_SEQUENTIAL);
+        return write_all((const char *)p, n);
+    }
+    for (; n > 0; n -= k) {
+        k = n < sizeof(zeros) ? n : sizeof(zeros);
+        if (write_all(zeros, k) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    printf("=== Superblock ===\n");
-    printf("Magic: 0x%x\n", sb.s_magic);
-    printf("Inodes Count: %u\n", sb.s_inodes_count);
-    printf("Blocks Count: %u\n", sb.s_blocks_count);
-    printf("Block size (log): %u\n", sb.s_log_block_size);
-    printf("Size of group descriptor = %lu bytes\n", sizeof(struct ext2_group_desc));
+// Writes the contents of inode to standard output
+static int extract(const ext2_t *fs, const struct ext2_inode *inode) {
+    extract_t x = {fs, ext2_size(inode)};
+
+    // a fast symlink keeps its target in i_block itself
+    if (!inode->i_blocks && x.left <= sizeof(inode->i_block))
+        return write_all((const char *)inode->i_block, x.left);
+    if (ext2_runs(fs, inode, write_run, &x) < 0)
+        return -1;
+    // blocks past the last pointer read as zeros, like a hole
+    return x.left ? write_run(&x, 0, (x.left + fs->block_size - 1) / fs->block_size) : 0;
+}
 
-    inode_size = sb.s_inode_size;
-    block_size = 1024 << sb.s_log_block_size;
+// "12" and "/12" are inode numbers, as they always were; anything else is
+// a path resolved from the root directory. Returns 0 if the path does not
+// exist and -1 if the number is not an inode of this filesystem.
+static long resolve(const ext2_t *fs, ext2_dcache_t *dc, const char *arg) {
+    const char *p = arg[0] == '/' ? arg + 1 : arg;
+    unsigned long n;
+    char *end;
+
+    if (*p && strspn(p, "0123456789") == strlen(p)) {
+        errno = 0;
+        n = strtoul(p, &end, 10);
+        if (errno || *end || n == 0 || n > fs->sb->s_inodes_count)
+            return -1;
+        return n;
+    }
+    return ext2_namei(fs, dc, arg);
+}
 
-    bgno = (ino - 1) / sb.s_inodes_per_group;
-    index = (ino - 1) % sb.s_inodes_per_group;
+// -: read paths from stdin, one per line, and print "<inode> <path>" for
+// each (inode 0 if the path does not exist). Lines are resolved as on the
+// command line, so a number names itself if it is in range. Directories
+// read for one path stay in the cache for the rest.
+static void batch(const ext2_t *fs) {
+    ext2_dcache_t dc;
+    char *line = 0;
+    size_t cap = 0;
+    ssize_t n;
+    long ino;
+
+    ext2_dcache_init(&dc, fs);
+    while ((n = getline(&line, &cap, stdin)) > 0) {
+        if (line[n - 1] == '\n')
+            line[--n] = 0;
+        ino = resolve(fs, &dc, line);
+        printf("%ld %s\n", ino < 0 ? 0 : ino, line);
+    }
+    ext2_dcache_free(&dc);
+    free(line);
+}
 
-    unsigned long gd_block = (block_size == 1024) ? 2 : 1;
-    unsigned long gd_offset = gd_block * block_size + bgno * sizeof(struct ext2_group_desc);
-    lseek64(fd, gd_offset, SEEK_SET);
-    count = read(fd, &bgdesc, sizeof(bgdesc));
+int main(int argc, char *argv[]) {
+    int i, r, contents;
+    long ino;
+    ext2_t fs;
+    const struct ext2_inode *inode;
+
+    if (argc < 3) {
+        printf("Usage: %s <imagefile> <inode number|path|-> [-c]\n", argv[0]);
+        printf("   -  : read paths from stdin and print their inode numbers\n");
+        printf("   -c : write the contents of the inode to stdout\n");
+        exit(1);
+    }
+    contents = argc > 3 && !strcmp(argv[3], "-c");
+
+    if ((r = ext2_open(&fs, argv[1])) < 0) {
+        if (r == -1) {
+            perror("open");
+            exit(errno);
+        }
+        printf("Not an ext2 filesystem\n");
+        exit(1);
+    }
 
-    printf("Inode Table starts at block: %u\n", bgdesc.bg_inode_table);
+    if (!strcmp(argv[2], "-")) {
+        batch(&fs);
+        ext2_close(&fs);
+        return 0;
+    }
+    if ((ino = resolve(&fs, 0, argv[2])) < 0) {
+        fprintf(stderr, "Inode %s out of range (only %u inodes)\n", argv[2], fs.sb->s_inodes_count);
+        exit(1);
+    }
+    if (!ino) {
+        fprintf(stderr, "%s: no such file or directory\n", argv[2]);
+        exit(1);
+    }
 
-    unsigned int inodes_per_block = block_size / inode_size;
-    unsigned int block_index = index / inodes_per_block;
-    unsigned int offset_in_block = (index % inodes_per_block) * inode_size;
+    if (contents) {
+        if (!(inode = ext2_inode(&fs, ino))) {
+            fprintf(stderr, "Inode %ld out of range (only %u inodes)\n", ino, fs.sb->s_inodes_count);
+            exit(1);
+        }
+        if (extract(&fs, inode) < 0) {
+            fprintf(stderr, "Cannot read inode %ld: bad block pointer or write error\n", ino);
+            exit(1);
+        }
+        ext2_close(&fs);
+        return 0;
+    }
 
-    inode_offset = ((unsigned long)bgdesc.bg_inode_table + block_index) * block_size + offset_in_block;
+    printf("=== Superblock ===\n");
+    printf("Magic: 0x%x\n", fs.sb->s_magic);
+    printf("Inodes Count: %u\n", fs.sb->s_inodes_count);
+    printf("Blocks Count: %u\n", fs.sb->s_blocks_count);
+    printf("Block size (log): %u\n", fs.sb->s_log_block_size);
+    printf("Size of group descriptor = %lu bytes\n", sizeof(struct ext2_group_desc));
 
-    lseek64(fd, inode_offset, SEEK_SET);
-    count = read(fd, &inode, sizeof(inode));
-    if (count != sizeof(inode)) { perror("read inode"); exit(1); }
+    if (!(inode = ext2_inode(&fs, ino))) {
+        printf("Inode %ld out of range (only %u inodes)\n", ino, fs.sb->s_inodes_count);
+        exit(1);
+    }
+    printf("Inode Table starts at block: %u\n",
+           ext2_group(&fs, (ino - 1) / fs.sb->s_inodes_per_group)->bg_inode_table);
 
-    printf("\n=== Inode %d Information ===\n", ino);
-    printf("Mode: %o\n", inode.i_mode);
-    printf("UID: %u\n", inode.i_uid);
-    printf("GID: %u\n", inode.i_gid);
-    printf("Links count: %u\n", inode.i_links_count);
-    printf("File size: %u bytes\n", inode.i_size);
-    printf("Blocks count: %u\n", inode.i_blocks);
+    printf("\n=== Inode %ld Information ===\n", ino);
+    printf("Mode: %o\n", inode->i_mode);
+    printf("UID: %u\n", inode->i_uid);
+    printf("GID: %u\n", inode->i_gid);
+    printf("Links count: %u\n", inode->i_links_count);
+    printf("File size: %u bytes\n", inode->i_size);
+    printf("Blocks count: %u\n", inode->i_blocks);
 
     for (i = 0; i < EXT2_N_BLOCKS; i++) {
-        if (inode.i_block[i] != 0)
-            printf("Block[%d]: %u\n", i, inode.i_block[i]);
+        if (inode->i_block[i] != 0)
+            printf("Block[%d]: %u\n", i, inode->i_block[i]);
     }
 
-    close(fd);
+    ext2_close(&fs);
+    return 0;
 }
-
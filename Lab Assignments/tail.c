@@ -0,0 +1,82 @@
+/*
+Companion to head.c for xv6: print the last lines (or bytes) of a file.
+
+Needs the lseek() system call from lseek_system_call_in_xv6.patch. Rather
+than reading the whole file, tail seeks to the end and reads backwards one
+block at a time until it has seen enough newlines, then copies from there
+to the end in whole blocks.
+
+Also add _tail to UPROGS in the Makefile.
+*/
+
+#include"types.h"
+#include"stat.h"
+#include"user.h"
+#include"fcntl.h"
+
+#define BUF_SIZE 4096
+
+// Static so the buffer does not eat into the one-page user stack
+static char buf[BUF_SIZE];
+
+// Offset where the last `count` lines of the file start. A newline that
+// ends the file does not start another line.
+int find_start(int fd, int size, int count){
+    int pos=size, len, i;
+
+    while(pos>0){
+        len = pos<BUF_SIZE ? pos : BUF_SIZE;
+        pos -= len;
+        if(lseek(fd, pos, SEEK_SET)<0 || read(fd, buf, len)!=len)
+            return -1;
+        for(i=len-1; i>=0; i--){
+            if(buf[i]!='\n' || pos+i==size-1)
+                continue;
+            if(--count==0)
+                return pos+i+1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int fd, i=1, n;
+    int count=10, bytes=0, size, start;
+
+    // tail [-n lines | -c bytes] file
+    if(i+1<argc && (strcmp(argv[i], "-n")==0 || strcmp(argv[i], "-c")==0)){
+        bytes = argv[i][1]=='c';
+        count = atoi(argv[i+1]);
+        i += 2;
+    }
+    if(i>=argc){
+        printf(2, "usage: tail [-n lines | -c bytes] file\n");
+        exit();
+    }
+
+    if((fd=open(argv[i], O_RDONLY))<0){
+        printf(2, "tail: cannot open %s\n", argv[i]);
+        exit();
+    }
+    if((size=lseek(fd, 0, SEEK_END))<0){
+        printf(2, "tail: cannot seek %s\n", argv[i]);
+        close(fd);
+        exit();
+    }
+
+    if(count<=0)
+        start = size;
+    else if(bytes)
+        start = size>count ? size-count : 0;
+    else
+        start = find_start(fd, size, count);
+
+    if(start<0 || lseek(fd, start, SEEK_SET)<0){
+        printf(2, "tail: read error\n");
+    } else {
+        while((n=read(fd, buf, sizeof(buf)))>0)
+            if(write(1, buf, n)!=n) break;
+    }
+    close(fd);
+    exit();
+}
@@ -0,0 +1,60 @@
+/*
+On-disk trigram index shared by grepindex.c (which writes it) and grep.c
+(which reads it). "file.tri" describes "file" as a sequence of line-aligned
+blocks and lists, for every trigram in the file, the blocks containing it.
+
+Layout, all little-endian, meant to be used straight from an mmap:
+    struct tri_header
+    unsigned long block_off[nblocks+1]      start of each block, then file size
+    struct tri_entry entries[ntri]          sorted by trigram
+    posting lists                           block numbers as varint deltas
+*/
+
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#define TRI_MAGIC 0x31495254u    //"TRI1"
+#define TRI_BLOCK (64*1024)      //target block size, rounded up to a line end
+
+struct tri_header {
+    unsigned int magic;
+    unsigned int nblocks;
+    unsigned long ntri;
+    unsigned long file_size;     //the index is stale if these no longer match
+    long mtime_sec, mtime_nsec;
+};
+
+struct tri_entry {
+    unsigned int tri;            //bytes b0 b1 b2 as b0<<16 | b1<<8 | b2
+    unsigned int count;          //number of blocks in the posting list
+    unsigned long off;           //of the posting list, from the list area start
+};
+
+static inline unsigned int tri_of(const char *p){
+    return (unsigned char)p[0]<<16 | (unsigned char)p[1]<<8 | (unsigned char)p[2];
+}
+
+static inline unsigned char *tri_put_varint(unsigned char *p, unsigned long v){
+    while(v>=0x80){
+        *p++=v|0x80;
+        v>>=7;
+    }
+    *p++=v;
+    return p;
+}
+
+//Returns 0 if the varint runs past end or does not fit in 64 bits
+static inline const unsigned char *tri_get_varint(const unsigned char *p, const unsigned char *end, unsigned long *v){
+    unsigned long x=0;
+    int shift=0;
+    for(; p<end && shift<64; shift+=7){
+        x|=(unsigned long)(*p&0x7f)<<shift;
+        if(!(*p++&0x80)){
+            *v=x;
+            return p;
+        }
+    }
+    return 0;
+}
+
+#endif
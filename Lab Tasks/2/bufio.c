@@ -0,0 +1,110 @@
+#include<unistd.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include"bufio.h"
+
+bio_t bio_in={.fd=0, .line=0}, bio_out={.fd=1, .line=-1};
+
+static void flush_at_exit(){
+    bio_flush(&bio_out);
+}
+
+__attribute__((constructor))
+static void bio_init(){
+    atexit(flush_at_exit);
+}
+
+int bio_fill(bio_t *b){
+    long n;
+
+    if(b->err) return -1;
+    if(bio_out.line>0 && bio_out.len) bio_flush(&bio_out);
+    while((n=read(b->fd, b->buf, BIO_SIZE))<0 && errno==EINTR);
+    if(n<=0){
+        if(n<0) b->err=1;
+        b->pos=b->len=0;
+        return -1;
+    }
+    b->pos=1;
+    b->len=n;
+    return (unsigned char)b->buf[0];
+}
+
+int bio_flush(bio_t *b){
+    long n, done=0;
+
+    while(done<b->len){
+        if((n=write(b->fd, b->buf+done, b->len-done))<0){
+            if(errno==EINTR) continue;
+            b->err=1;
+            break;
+        }
+        done+=n;
+    }
+    b->len=0;
+    return b->err ? -1 : 0;
+}
+
+int bio_putc_slow(bio_t *b, int c){
+    if(b->line<0) b->line=isatty(b->fd);
+    if(b->len==BIO_SIZE && bio_flush(b)<0) return -1;
+    b->buf[b->len++]=c;
+    if(b->line && c=='\n' && bio_flush(b)<0) return -1;
+    return (unsigned char)c;
+}
+
+long bio_write(bio_t *b, const void *s, long n){
+    const char *p=s;
+    long left=n, k;
+
+    if(b->line<0) b->line=isatty(b->fd);
+    while(left>0){
+        //a whole buffer's worth with nothing pending goes straight out
+        if(b->len==0 && left>=BIO_SIZE){
+            if((k=write(b->fd, p, left))<0){
+                if(errno==EINTR) continue;
+                b->err=1;
+                return -1;
+            }
+        } else {
+            k=left<BIO_SIZE-b->len ? left : BIO_SIZE-b->len;
+            memcpy(b->buf+b->len, p, k);
+            b->len+=k;
+            if(b->len==BIO_SIZE && bio_flush(b)<0) return -1;
+        }
+        p+=k;
+        left-=k;
+    }
+    if(b->line && n && memchr(s, '\n', n) && bio_flush(b)<0) return -1;
+    return n;
+}
+
+long bio_getline(bio_t *b, char **line, long *cap){
+    long len=0, k;
+    char *nl;
+
+    for(;;){
+        if(b->pos==b->len){
+            if(bio_fill(b)<0) break;
+            b->pos=0;
+        }
+        nl=memchr(b->buf+b->pos, '\n', b->len-b->pos);
+        k=(nl ? nl+1-b->buf : b->len)-b->pos;
+        if(len+k+1>*cap){
+            long c=*cap ? *cap : 128;
+            while(c<len+k+1) c*=2;
+            char *p=realloc(*line, c);
+            if(!p) return -1;
+            *line=p;
+            *cap=c;
+        }
+        memcpy(*line+len, b->buf+b->pos, k);
+        b->pos+=k;
+        len+=k;
+        if(nl) break;
+    }
+    if(len==0) return -1;
+    (*line)[len]=0;
+    return len;
+}
@@ -0,0 +1,53 @@
+/*
+Small buffered I/O layer over read(2) and write(2), for the programs that
+only use system calls and move a byte at a time (getputchar.c so far; grep.c
+does its own buffering). Each stream keeps one BIO_SIZE buffer, so a byte at
+a time through bio_getc()/bio_putc() costs a system call per BIO_SIZE bytes
+instead of one per byte.
+
+Output is fully buffered, or line buffered when it goes to a terminal, and
+is flushed by bio_flush() or at exit. Reading stdin flushes a line buffered
+stdout first, so prompts show up before the program blocks.
+*/
+
+#ifndef BUFIO_H
+#define BUFIO_H
+
+#define BIO_SIZE (64*1024)
+
+typedef struct {
+    int fd;
+    int line;            //1 line buffered, 0 fully buffered, -1 not decided yet
+    int pos, len;        //reading: next byte and bytes held; writing: bytes held
+    int err;             //set once a read or write fails
+    char buf[BIO_SIZE];
+} bio_t;
+
+extern bio_t bio_in, bio_out;
+
+int bio_fill(bio_t *b);
+int bio_flush(bio_t *b);
+int bio_putc_slow(bio_t *b, int c);
+long bio_write(bio_t *b, const void *s, long n);
+long bio_getline(bio_t *b, char **line, long *cap);
+
+//next byte as an unsigned char, or -1 at end of input or on error
+static inline int bio_getc(bio_t *b){
+    return b->pos<b->len ? (unsigned char)b->buf[b->pos++] : bio_fill(b);
+}
+
+//c, or -1 on error
+static inline int bio_putc(bio_t *b, int c){
+    if(b->line==0 && b->len<BIO_SIZE) return (unsigned char)(b->buf[b->len++]=c);
+    return bio_putc_slow(b, c);
+}
+
+static inline int mygetchar(void){ return bio_getc(&bio_in); }
+static inline int myputchar(int c){ return bio_putc(&bio_out, c); }
+static inline int myflush(void){ return bio_flush(&bio_out); }
+
+//reads a line, newline included, into *line (grown with realloc as needed)
+//and returns its length, or -1 at end of input
+static inline long mygetline(char **line, long *cap){ return bio_getline(&bio_in, line, cap); }
+
+#endif
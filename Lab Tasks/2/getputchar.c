@@ -1,27 +1,18 @@
 /*
 Write a program that demonstrates read(0, ...) and write(1, ...) works.  In this write a function mygetchar() and myputchar() which works like getchar() and putchar() respectively.   Filename: getputchar.c
 */
-#include <stdio.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include "bufio.h"
 
-char mygetchar() {
-    char c;
-    if (read(0, &c, 1) == 1)
-        return c;
-    else
-        return -1;
-}
-
-void myputchar(char c) {
-    write(1, &c, 1);
-}
+// mygetchar() and myputchar() come from bufio.h: they read and write
+// through a 64 KiB buffer, so copying a file costs one read() and one
+// write() per 64 KiB instead of one of each per byte.
+// Build with: gcc -O2 -o getputchar getputchar.c bufio.c
 
 int main() {
-    char c;
+    int c;
 
     while ((c = mygetchar()) != -1) {
-        myputchar(c);  
+        myputchar(c);
     }
+    return 0;
 }
-
@@ -0,0 +1,362 @@
+//Write a program that checks every block group of an ext2 file system, a
+//small read-only fsck: bitmaps against the inode tables, and the free
+//counts in the group descriptors against the bitmaps.
+//
+//Build: gcc -O2 -pthread -o groupscan groupscan.c
+//
+//Groups are handed out to a pool of threads (-j, one per CPU by default).
+//The first pass reads each group's inode table, compares it with the inode
+//bitmap, and marks every block the inodes (and the file system's own
+//metadata) use in a shared bitmap of the whole image. The second pass
+//compares that with each group's block bitmap. Counting bits is done 256
+//at a time with AVX2 when the CPU has it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../../Lab Assignments/ext2img.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+typedef struct {
+    long free_blocks, free_inodes, dirs;        //counted from the bitmaps and table
+    long inode_unmarked, inode_unused;          //in use but free in the bitmap, and the reverse
+    long block_unmarked, block_unused;
+    long dup_blocks, bad_blocks;                //claimed twice, and pointing outside the image
+    unsigned long first_inode, first_block;     //an example of each kind of mismatch
+} result_t;
+
+static ext2_t fs;
+static result_t *results;
+static uint64_t *used;           //blocks in use, bit b - s_first_data_block
+static unsigned long nblocks;    //blocks covered by the groups
+static int pass;
+static unsigned long next_group;
+static __thread uint64_t *bits, *bits2;   //a group's worth of bits, per thread
+
+static unsigned long popcount_scalar(const uint64_t *p, unsigned long n) {
+    unsigned long c = 0;
+    for (unsigned long i = 0; i < n; i++)
+        c += __builtin_popcountll(p[i]);
+    return c;
+}
+
+#ifdef HAVE_X86
+//Looks up the bit count of each nibble with a shuffle and adds the bytes
+//up with a sum of absolute differences against zero
+__attribute__((target("avx2")))
+static unsigned long popcount_avx2(const uint64_t *p, unsigned long n) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned long i = 0, c;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                                      _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    c = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1)
+        + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+    return c + popcount_scalar(p + i, n - i);
+}
+#endif
+
+static unsigned long (*popcount)(const uint64_t *p, unsigned long n) = popcount_scalar;
+
+//64 bits of b starting at bit off
+static uint64_t bits_at(const uint64_t *b, unsigned long off) {
+    unsigned long w = off / 64, s = off % 64;
+    return s ? b[w] >> s | b[w + 1] << (64 - s) : b[w];
+}
+
+//Copies nbits bits of b from bit off into out, zeroing the rest of the last word
+static void get_bits(uint64_t *out, const uint64_t *b, unsigned long off, unsigned long nbits) {
+    unsigned long n = (nbits + 63) / 64;
+    for (unsigned long i = 0; i < n; i++)
+        out[i] = bits_at(b, off + i * 64);
+    if (nbits % 64)
+        out[n - 1] &= (1UL << nbits % 64) - 1;
+}
+
+//set bits among the first nbits of bitmap
+static unsigned long popcount_bits(const void *bitmap, unsigned long nbits) {
+    get_bits(bits, bitmap, 0, nbits);
+    return popcount(bits, (nbits + 63) / 64);
+}
+
+//Marks count blocks from blk as used; returns how many were marked already
+static long mark(unsigned long blk, unsigned long count) {
+    unsigned long b = blk - fs.sb->s_first_data_block, end = b + count;
+    long dup = 0;
+
+    while (b < end) {
+        unsigned long k = 64 - b % 64 < end - b ? 64 - b % 64 : end - b;
+        uint64_t m = (k == 64 ? ~0UL : (1UL << k) - 1) << b % 64;
+        dup += __builtin_popcountll(__atomic_fetch_or(&used[b / 64], m, __ATOMIC_RELAXED) & m);
+        b += k;
+    }
+    return dup;
+}
+
+static int valid(unsigned long blk, unsigned long count) {
+    return blk >= fs.sb->s_first_data_block && blk + count <= fs.sb->s_first_data_block + nblocks;
+}
+
+static int mark_run(void *arg, unsigned long blk, unsigned long count) {
+    result_t *r = arg;
+
+    if (!blk)
+        return 0;
+    if (!valid(blk, count)) {
+        r->bad_blocks += count;
+        return 0;
+    }
+    r->dup_blocks += mark(blk, count);
+    return 0;
+}
+
+static int has_super(unsigned long g) {
+    if (g <= 1 || !(fs.sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return 1;
+    for (unsigned long p = 3; p <= 7; p += 2) {
+        unsigned long x = p;
+        while (x < g)
+            x *= p;
+        if (x == g)
+            return 1;
+    }
+    return 0;
+}
+
+static void scan_inodes(unsigned long g, result_t *r) {
+    const struct ext2_group_desc *gd = ext2_group(&fs, g);
+    unsigned long ipg = fs.sb->s_inodes_per_group, bs = fs.block_size;
+    unsigned long start = fs.sb->s_first_data_block + g * fs.sb->s_blocks_per_group;
+    unsigned long table_blocks = (ipg * fs.inode_size + bs - 1) / bs;
+    const unsigned char *bitmap = ext2_block(&fs, gd->bg_inode_bitmap);
+    const unsigned char *table = ext2_block(&fs, gd->bg_inode_table);
+
+    unsigned long meta = 1 + (fs.groups * sizeof(struct ext2_group_desc) + bs - 1) / bs
+                         + fs.sb->s_reserved_gdt_blocks;
+
+    //the file system's own blocks: superblock and descriptor table copies,
+    //then the bitmaps and inode table wherever the descriptor puts them.
+    //mark() directly, since block 0 holds the superblock with 4 KiB blocks
+    //and mark_run() would take it for a hole
+    if (has_super(g) && valid(start, meta))
+        mark(start, meta);
+    mark_run(r, gd->bg_block_bitmap, 1);
+    mark_run(r, gd->bg_inode_bitmap, 1);
+    mark_run(r, gd->bg_inode_table, table_blocks);
+    if (!bitmap || !table || !ext2_block(&fs, gd->bg_inode_table + table_blocks - 1))
+        return;
+
+    //start reading the whole table in now rather than a page per fault
+    madvise((void *)((unsigned long)table & ~4095UL), table_blocks * bs, MADV_WILLNEED);
+    r->free_inodes = ipg - popcount_bits(bitmap, ipg);
+
+    for (unsigned long i = 0; i < ipg; i++) {
+        unsigned long ino = g * ipg + i + 1;
+        const struct ext2_inode *in = (const struct ext2_inode *)(table + i * fs.inode_size);
+        int marked = bitmap[i / 8] >> (i % 8) & 1, type = in->i_mode & 0170000;
+        int in_use = in->i_links_count && !in->i_dtime;
+
+        if (ino == EXT2_RESIZE_INO) {
+            //its blocks are the reserved descriptor blocks, marked above
+            mark_run(r, in->i_block[EXT2_DIND_BLOCK], 1);
+            continue;
+        }
+        if (ino < fs.sb->s_first_ino && ino != EXT2_ROOT_INO) {
+            //reserved inodes are always marked, used or not
+            if (in->i_blocks && ext2_blocks(&fs, in, mark_run, mark_run, r) < 0)
+                r->bad_blocks++;
+            continue;
+        }
+        if (in_use != marked) {
+            if (marked)
+                r->inode_unused++;
+            else
+                r->inode_unmarked++;
+            if (!r->first_inode)
+                r->first_inode = ino;
+        }
+        if (!in_use)
+            continue;
+        if (type == 0040000)
+            r->dirs++;
+        if (in->i_file_acl)
+            mark_run(r, in->i_file_acl, 1);
+        //device files keep a device number in i_block, not blocks
+        if ((type == 0100000 || type == 0040000 || type == 0120000) && in->i_blocks
+            && ext2_blocks(&fs, in, mark_run, mark_run, r) < 0)
+            r->bad_blocks++;
+    }
+}
+
+static void scan_blocks(unsigned long g, result_t *r) {
+    const struct ext2_group_desc *gd = ext2_group(&fs, g);
+    const unsigned char *bitmap = ext2_block(&fs, gd->bg_block_bitmap);
+    unsigned long bpg = fs.sb->s_blocks_per_group;
+    unsigned long n = nblocks - g * bpg < bpg ? nblocks - g * bpg : bpg, words = (n + 63) / 64;
+    unsigned long start = fs.sb->s_first_data_block + g * bpg;
+
+    if (!bitmap)
+        return;
+    get_bits(bits, (const uint64_t *)bitmap, 0, n);
+    get_bits(bits2, used, g * bpg, n);
+    r->free_blocks = n - popcount(bits, words);
+    for (unsigned long i = 0; i < words; i++) {
+        uint64_t disk = bits[i], want = bits2[i];
+        bits[i] = disk & ~want;
+        bits2[i] = want & ~disk;
+        if (!r->first_block && (disk ^ want))
+            r->first_block = start + i * 64 + __builtin_ctzll(disk ^ want);
+    }
+    r->block_unused = popcount(bits, words);
+    r->block_unmarked = popcount(bits2, words);
+}
+
+static void *worker(void *arg) {
+    unsigned long g, words = (fs.sb->s_blocks_per_group > fs.sb->s_inodes_per_group ?
+                              fs.sb->s_blocks_per_group : fs.sb->s_inodes_per_group) / 64 + 1;
+
+    (void)arg;
+    bits = malloc(words * sizeof(uint64_t));
+    bits2 = malloc(words * sizeof(uint64_t));
+    if (!bits || !bits2) {
+        perror("malloc");
+        exit(2);
+    }
+    while ((g = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED)) < fs.groups) {
+        if (pass == 1)
+            scan_inodes(g, &results[g]);
+        else
+            scan_blocks(g, &results[g]);
+    }
+    free(bits);
+    free(bits2);
+    return 0;
+}
+
+//Workers take groups until none are left, so the pass completes with however
+//many threads could be started; if none could, the main thread does it all.
+static void run_pass(int p, pthread_t *tid, int nthreads) {
+    int started, err = 0;
+
+    pass = p;
+    next_group = 0;
+    for (started = 0; started < nthreads; started++) {
+        if ((err = pthread_create(&tid[started], 0, worker, 0)) != 0)
+            break;
+    }
+    if (err)
+        fprintf(stderr, "pthread_create: %s (continuing with %d threads)\n", strerror(err), started);
+    if (!started)
+        worker(0);
+    for (int i = 0; i < started; i++)
+        pthread_join(tid[i], 0);
+}
+
+static long check(const char *where, const char *what, long on_disk, long counted) {
+    if (on_disk == counted)
+        return 0;
+    printf("%s: %ld %s recorded, %ld counted\n", where, on_disk, what, counted);
+    return 1;
+}
+
+static long report(unsigned long g, const char *what, long n, unsigned long first) {
+    if (!n)
+        return 0;
+    if (first)
+        printf("Group %lu: %ld %s (first %lu)\n", g, n, what, first);
+    else
+        printf("Group %lu: %ld %s\n", g, n, what);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN), i = 1;
+    long problems = 0, free_blocks = 0, free_inodes = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-j")) {
+        nthreads = atoi(argv[2]);
+        i = 3;
+    }
+    if (i >= argc || nthreads < 1) {
+        printf("Usage: %s [-j threads] <fs_image>\n", argv[0]);
+        return 2;
+    }
+
+    int r = ext2_open(&fs, argv[i]);
+    if (r == -1) {
+        perror("open");
+        return 2;
+    }
+    if (r == -2) {
+        printf("Not an ext2 filesystem\n");
+        return 2;
+    }
+
+#ifdef HAVE_X86
+    if (__builtin_cpu_supports("avx2"))
+        popcount = popcount_avx2;
+#endif
+    //Indirect blocks and bitmaps are single blocks scattered over the
+    //image; with the default read-around every fault on one would pull in
+    //the file data next to it too. The inode tables are asked for
+    //explicitly with MADV_WILLNEED instead.
+    madvise((void *)fs.map, fs.size, MADV_RANDOM);
+    nblocks = fs.sb->s_blocks_count - fs.sb->s_first_data_block;
+    results = calloc(fs.groups, sizeof(result_t));
+    used = calloc(nblocks / 64 + 2, sizeof(uint64_t));
+    if (!results || !used) {
+        perror("calloc");
+        return 2;
+    }
+
+    //more threads than groups would have nothing to take
+    if ((unsigned long)nthreads > fs.groups)
+        nthreads = fs.groups;
+    pthread_t *tid = malloc(nthreads * sizeof(pthread_t));
+    if (!tid) {
+        perror("malloc");
+        return 2;
+    }
+
+    //every inode has to be seen before any block bitmap can be checked
+    run_pass(1, tid, nthreads);
+    run_pass(2, tid, nthreads);
+    free(tid);
+
+    for (unsigned long g = 0; g < fs.groups; g++) {
+        const struct ext2_group_desc *gd = ext2_group(&fs, g);
+        result_t *x = &results[g];
+        char where[32];
+
+        snprintf(where, sizeof(where), "Group %lu", g);
+        problems += check(where, "free blocks", gd->bg_free_blocks_count, x->free_blocks);
+        problems += check(where, "free inodes", gd->bg_free_inodes_count, x->free_inodes);
+        problems += check(where, "directories", gd->bg_used_dirs_count, x->dirs);
+        problems += report(g, "inodes in use but free in the bitmap", x->inode_unmarked, x->first_inode);
+        problems += report(g, "inodes marked in the bitmap but unused", x->inode_unused, x->first_inode);
+        problems += report(g, "blocks in use but free in the bitmap", x->block_unmarked, x->first_block);
+        problems += report(g, "blocks marked in the bitmap but unused", x->block_unused, x->first_block);
+        problems += report(g, "blocks claimed more than once", x->dup_blocks, 0);
+        problems += report(g, "block pointers outside the file system", x->bad_blocks, 0);
+        free_blocks += x->free_blocks;
+        free_inodes += x->free_inodes;
+    }
+    problems += check("Superblock", "free blocks", fs.sb->s_free_blocks_count, free_blocks);
+    problems += check("Superblock", "free inodes", fs.sb->s_free_inodes_count, free_inodes);
+
+    printf("%u groups, %ld free blocks, %ld free inodes: %ld problem%s\n",
+           fs.groups, free_blocks, free_inodes, problems, problems == 1 ? "" : "s");
+    ext2_close(&fs);
+    return problems != 0;
+}
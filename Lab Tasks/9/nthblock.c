@@ -1,152 +1,174 @@
-//Write another program to print n'th data block from an ext2 file system. 
+//Write another program to print n'th data block from an ext2 file system.
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <stdint.h>
 #include <string.h>
-#include <ctype.h>
-
-#define EXT2_SUPER_OFFSET 1024
-#define EXT2_SUPER_MAGIC  0xEF53
-
-// minimal ext2 superblock (fields we need)
-struct ext2_super_block {
-    uint32_t s_inodes_count;
-    uint32_t s_blocks_count;
-    uint32_t s_r_blocks_count;
-    uint32_t s_free_blocks_count;
-    uint32_t s_free_inodes_count;
-    uint32_t s_first_data_block;
-    uint32_t s_log_block_size;
-    uint32_t s_log_frag_size;
-    uint32_t s_blocks_per_group;
-    uint32_t s_frags_per_group;
-    uint32_t s_inodes_per_group;
-    uint32_t s_mtime;
-    uint32_t s_wtime;
-    uint16_t s_mnt_count;
-    uint16_t s_max_mnt_count;
-    uint16_t s_magic;
-    uint16_t s_state;
-    uint16_t s_errors;
-    uint16_t s_minor_rev_level;
-    uint32_t s_lastcheck;
-    uint32_t s_checkinterval;
-    uint32_t s_creator_os;
-    uint32_t s_rev_level;
-    uint16_t s_def_resuid;
-    uint16_t s_def_resgid;
-    uint32_t s_first_ino;
-    uint16_t s_inode_size;
-    uint16_t s_block_group_nr;
-    uint32_t s_feature_compat;
-    uint32_t s_feature_incompat;
-    uint32_t s_feature_ro_compat;
-    uint8_t  s_uuid[16];
-    uint8_t  s_volume_name[16];
-    uint8_t  s_last_mounted[64];
-    uint32_t s_algorithm_usage_bitmap;
-};
+#include "../../Lab Assignments/ext2img.h"
+
+#define OUT_SIZE (64 * 1024)
+#define LINE_SIZE 76        // "%08x  " + 16 x "%02x " + " " + 16 chars + "\n"
+
+typedef struct {
+    unsigned long first, last;
+} range_t;
+
+static char hex[256][2];    // two hex digits of each byte
+static char shown[2][256];  // how each byte appears in -x and -a dumps
+static char out[OUT_SIZE];
+static unsigned long out_len;
 
 static void usage(char *prog) {
-    printf("Usage: %s <imagefile> <blockno> [-x|-a]\n", prog);
+    printf("Usage: %s <imagefile> <blocks> [-x|-a]\n", prog);
+    printf("   blocks : a block number, a range like 10-20, or a list like 1,5,10-20\n");
     printf("   -x : hex dump\n");
     printf("   -a : ascii dump (printable only)\n");
 }
 
+static void init_tables(void) {
+    for (int c = 0; c < 256; c++) {
+        hex[c][0] = "0123456789abcdef"[c >> 4];
+        hex[c][1] = "0123456789abcdef"[c & 15];
+        shown[0][c] = c >= 0x20 && c < 0x7f ? c : '.';
+        shown[1][c] = c >= 0x20 && c < 0x7f ? c : c == '\n' || c == '\t' ? c : '.';
+    }
+}
+
+static void flush_out(void) {
+    fwrite(out, 1, out_len, stdout);
+    out_len = 0;
+}
+
+// Formats one 16-byte line of the hex dump at p, offset off into the block
+static char *hex_line(char *p, const unsigned char *b, unsigned off) {
+    for (int k = 24; k >= 0; k -= 8) {
+        *p++ = hex[(off >> k) & 255][0];
+        *p++ = hex[(off >> k) & 255][1];
+    }
+    *p++ = ' ';
+    *p++ = ' ';
+    for (int i = 0; i < 16; i++) {
+        *p++ = hex[b[i]][0];
+        *p++ = hex[b[i]][1];
+        *p++ = ' ';
+    }
+    *p++ = ' ';
+    for (int i = 0; i < 16; i++)
+        *p++ = shown[0][b[i]];
+    *p++ = '\n';
+    return p;
+}
+
+// Headers and lines are built in out and reach stdout in OUT_SIZE pieces
+static void dump(const unsigned char *buf, unsigned long blk, unsigned block_size, char mode) {
+    if (out_len + 64 > OUT_SIZE)
+        flush_out();
+    out_len += sprintf(out + out_len, "%s dump of block %lu:\n", mode == 'x' ? "Hex" : "ASCII", blk);
+    if (mode == 'x') {
+        for (unsigned i = 0; i < block_size; i += 16) {
+            if (out_len + LINE_SIZE > OUT_SIZE)
+                flush_out();
+            out_len = hex_line(out + out_len, buf + i, i) - out;
+        }
+    } else {
+        for (unsigned i = 0; i < block_size; i++) {
+            if (out_len == OUT_SIZE)
+                flush_out();
+            out[out_len++] = shown[1][buf[i]];
+        }
+        if (out_len == OUT_SIZE)
+            flush_out();
+        out[out_len++] = '\n';
+    }
+}
+
+// Parses "1,5,10-20" into ranges; returns how many, or -1 if malformed
+static int parse_blocks(char *s, range_t **ranges) {
+    int n = 0;
+    char *end;
+
+    *ranges = 0;
+    for (;;) {
+        range_t r;
+        if (*s < '0' || *s > '9')
+            return -1;
+        r.first = r.last = strtoul(s, &end, 10);
+        if (*end == '-') {
+            s = end + 1;
+            if (*s < '0' || *s > '9')
+                return -1;
+            r.last = strtoul(s, &end, 10);
+            if (r.last < r.first)
+                return -1;
+        }
+        if (!(*ranges = realloc(*ranges, (n + 1) * sizeof(range_t)))) {
+            perror("realloc");
+            exit(1);
+        }
+        (*ranges)[n++] = r;
+        if (*end == 0)
+            return n;
+        if (*end != ',')
+            return -1;
+        s = end + 1;
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 3) {
         usage(argv[0]);
         return 1;
     }
 
-    int fd = open(argv[1], O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        return 1;
-    }
-
-    int blk = atoi(argv[2]);
+    range_t *ranges;
+    int nranges = parse_blocks(argv[2], &ranges);
     char mode = 'x';   // default hex
     if (argc > 3) {
         if (!strcmp(argv[3], "-a")) mode = 'a';
         else if (!strcmp(argv[3], "-x")) mode = 'x';
         else {
             usage(argv[0]);
-            close(fd);
             return 1;
         }
     }
-
-    // read superblock
-    struct ext2_super_block sb;
-    lseek(fd, EXT2_SUPER_OFFSET, SEEK_SET);
-    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-        perror("read superblock");
-        close(fd);
-        return 1;
-    }
-    if (sb.s_magic != EXT2_SUPER_MAGIC) {
-        printf("Not an ext2 filesystem\n");
-        close(fd);
+    if (nranges < 0) {
+        usage(argv[0]);
         return 1;
     }
 
-    unsigned block_size = 1024 << sb.s_log_block_size;
-    if (blk >= (int)sb.s_blocks_count) {
-        printf("Block %d out of range (only %u blocks)\n", blk, sb.s_blocks_count);
-        close(fd);
+    ext2_t fs;
+    int r = ext2_open(&fs, argv[1]);
+    if (r == -1) {
+        perror("open");
         return 1;
     }
-
-    // seek and read block
-    off_t offset = (off_t)blk * block_size;
-    lseek(fd, offset, SEEK_SET);
-
-    unsigned char *buf = malloc(block_size);
-    if (!buf) {
-        perror("malloc");
-        close(fd);
+    if (r == -2) {
+        printf("Not an ext2 filesystem\n");
         return 1;
     }
 
-    if (read(fd, buf, block_size) != (ssize_t)block_size) {
-        perror("read block");
-        free(buf);
-        close(fd);
-        return 1;
+    // check every block before dumping any
+    unsigned block_size = fs.block_size;
+    for (int i = 0; i < nranges; i++) {
+        if (ranges[i].last >= fs.sb->s_blocks_count || !ext2_block(&fs, ranges[i].last)) {
+            printf("Block %lu out of range (only %u blocks)\n", ranges[i].last, fs.sb->s_blocks_count);
+            ext2_close(&fs);
+            return 1;
+        }
     }
 
-    // dump block
-    if (mode == 'x') {
-        printf("Hex dump of block %d:\n", blk);
-        for (unsigned i = 0; i < block_size; i++) {
-            if (i % 16 == 0) printf("%08x  ", i);
-            printf("%02x ", buf[i]);
-            if ((i+1) % 16 == 0) {
-                printf(" ");
-                for (unsigned j = i-15; j <= i; j++) {
-                    printf("%c", isprint(buf[j]) ? buf[j] : '.');
-                }
-                printf("\n");
-            }
-        }
-    } else if (mode == 'a') {
-        printf("ASCII dump of block %d:\n", blk);
-        for (unsigned i = 0; i < block_size; i++) {
-            char c = buf[i];
-            if (isprint(c) || c == '\n' || c == '\t')
-                putchar(c);
-            else
-                putchar('.');
-        }
-        printf("\n");
+    init_tables();
+    for (int i = 0; i < nranges; i++) {
+        const unsigned char *buf = ext2_block(&fs, ranges[i].first);
+        unsigned long len = (ranges[i].last - ranges[i].first + 1) * block_size;
+
+        // a range is read from the image front to back, so let readahead run
+        madvise((void *)((unsigned long)buf & ~4095UL), len + ((unsigned long)buf & 4095), MADV_SEQUENTIAL);
+        for (unsigned long blk = ranges[i].first; blk <= ranges[i].last; blk++, buf += block_size)
+            dump(buf, blk, block_size, mode);
     }
 
-    free(buf);
-    close(fd);
+    flush_out();
+    free(ranges);
+    ext2_close(&fs);
     return 0;
 }
-